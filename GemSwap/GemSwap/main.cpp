@@ -8,6 +8,28 @@
 #include <iostream>
 #include <cstdlib>
 #include <string>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <new>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <malloc.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 
 
@@ -105,15 +127,295 @@ struct vec2
     }
 };
 
-double time_glob = 0;
+// simulation clock, advanced in fixed ticks of sim_dt by the simulation loop. one per thread, so
+// headless replays can run scenes side by side on worker threads
+thread_local double time_glob = 0;
+thread_local long long sim_tick = 0;
+const double sim_dt = 1.0/120.0;
+// at most this many ticks are simulated per frame, any further backlog is dropped
+const int max_ticks_per_frame = 8;
+
+// clock the renderer sees, trails the newest published tick by up to one tick
+double render_time_glob = 0;
 double move_time = 0.5;
 double remove_time = 1.0;
 
+// build with -DGEMSWAP_TRACK_ALLOCS=0 to keep the library's operator new
+#ifndef GEMSWAP_TRACK_ALLOCS
+#define GEMSWAP_TRACK_ALLOCS 1
+#endif
+
+// subsystem an allocation is charged to, set for a block with AllocScope
+enum AllocTag {
+    ALLOC_OTHER,
+    ALLOC_INPUT,        // applyInput
+    ALLOC_RULES,        // Scene::Tick: removals, movements, removeLines, skyfall, fillgrid
+    ALLOC_FRAME,        // publishing frame snapshots
+    ALLOC_RENDER,       // onDisplay
+    ALLOC_TRACE,        // trace and event buffers
+    num_of_alloc_tags
+};
+
+const char* alloc_tag_names[num_of_alloc_tags] = {"other", "input", "rules", "frame", "render", "trace"};
+
+// everything operator new has handed out since startup, by tag. zero before any constructor runs
+std::atomic<unsigned long long> alloc_count[num_of_alloc_tags];
+std::atomic<unsigned long long> alloc_bytes[num_of_alloc_tags];
+thread_local int alloc_tag = ALLOC_OTHER;
+
+class AllocScope {
+    int saved;
+public:
+    AllocScope(int tag) : saved(alloc_tag) {
+        alloc_tag = tag;
+    }
+    ~AllocScope() {
+        alloc_tag = saved;
+    }
+};
+
+// counts read at one moment, subtract two to get what was allocated in between
+struct AllocCounts {
+    unsigned long long count[num_of_alloc_tags];
+    unsigned long long bytes[num_of_alloc_tags];
+    
+    AllocCounts() {
+        for(int t = 0; t < num_of_alloc_tags; t++) count[t] = bytes[t] = 0;
+    }
+    
+    static AllocCounts now() {
+        AllocCounts counts;
+        for(int t = 0; t < num_of_alloc_tags; t++) {
+            counts.count[t] = alloc_count[t].load(std::memory_order_relaxed);
+            counts.bytes[t] = alloc_bytes[t].load(std::memory_order_relaxed);
+        }
+        return counts;
+    }
+    
+    AllocCounts since(const AllocCounts& before) const {
+        AllocCounts delta;
+        for(int t = 0; t < num_of_alloc_tags; t++) {
+            delta.count[t] = count[t] - before.count[t];
+            delta.bytes[t] = bytes[t] - before.bytes[t];
+        }
+        return delta;
+    }
+    
+    unsigned long long total() const {
+        unsigned long long sum = 0;
+        for(int t = 0; t < num_of_alloc_tags; t++) sum += count[t];
+        return sum;
+    }
+    
+    // frames: what the per-frame means are taken over, 0 for none
+    void report(const char* title, unsigned long long frames) const {
+        printf("%s\n%-8s %12s %14s", title, "tag", "allocs", "bytes");
+        printf(frames > 0 ? " %12s %14s\n" : "\n", "allocs/frame", "bytes/frame");
+        for(int t = 0; t < num_of_alloc_tags; t++) {
+            if(count[t] == 0) {
+                continue;
+            }
+            printf("%-8s %12llu %14llu", alloc_tag_names[t], count[t], bytes[t]);
+            if(frames > 0) {
+                printf(" %12.2f %14.1f", count[t] / (double)frames, bytes[t] / (double)frames);
+            }
+            printf("\n");
+        }
+    }
+};
+
+#if GEMSWAP_TRACK_ALLOCS
+void countAlloc(size_t size) {
+    alloc_count[alloc_tag].fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes[alloc_tag].fetch_add(size, std::memory_order_relaxed);
+}
+
+void* trackedAlloc(size_t size) {
+    countAlloc(size);
+    return malloc(size != 0 ? size : 1);
+}
+
+// out of line: once a replaced operator delete is inlined, gcc sees free() take memory from operator
+// new and warns about the mismatch
+#if defined(_MSC_VER)
+__declspec(noinline)
+#elif defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void trackedFree(void* p) {
+    free(p);
+}
+
+void* operator new(size_t size) {
+    void* p = trackedAlloc(size);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    void* p = trackedAlloc(size);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return trackedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return trackedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {
+    trackedFree(p);
+}
+
+void operator delete[](void* p) noexcept {
+    trackedFree(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    trackedFree(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    trackedFree(p);
+}
+
+// sized deallocation, which the compiler calls instead of the above where it is enabled
+void operator delete(void* p, size_t) noexcept {
+    trackedFree(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    trackedFree(p);
+}
+
+#if defined(__cpp_aligned_new)
+// types aligned past what malloc guarantees. memory from these goes back through the aligned deletes
+void* trackedAlignedAlloc(size_t size, std::align_val_t alignment) {
+    countAlloc(size);
+    size = size != 0 ? size : 1;
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, (size_t)alignment);
+#else
+    void* p = NULL;
+    return posix_memalign(&p, std::max((size_t)alignment, sizeof(void*)), size) == 0 ? p : NULL;
+#endif
+}
+
+#if defined(_MSC_VER)
+__declspec(noinline)
+#elif defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void trackedAlignedFree(void* p) {
+#if defined(_MSC_VER)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* p = trackedAlignedAlloc(size, alignment);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    void* p = trackedAlignedAlloc(size, alignment);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return trackedAlignedAlloc(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return trackedAlignedAlloc(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    trackedAlignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    trackedAlignedFree(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    trackedAlignedFree(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    trackedAlignedFree(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    trackedAlignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    trackedAlignedFree(p);
+}
+#endif
+#endif
+
+// draws and GL state changes of one frame, counted where the GL calls are made. render thread only
+struct RenderStats {
+    unsigned int draw_calls;
+    unsigned int program_switches;      // Shader::Run
+    unsigned int vao_binds;
+    unsigned int texture_binds;
+    unsigned int uniform_uploads;       // UploadM, UploadColor, UploadSamplerID
+    unsigned int blend_toggles;         // glEnable/glDisable(GL_BLEND)
+    
+    RenderStats() {
+        draw_calls = program_switches = vao_binds = texture_binds = uniform_uploads = blend_toggles = 0;
+    }
+    
+    void add(const RenderStats& stats) {
+        draw_calls += stats.draw_calls;
+        program_switches += stats.program_switches;
+        vao_binds += stats.vao_binds;
+        texture_binds += stats.texture_binds;
+        uniform_uploads += stats.uniform_uploads;
+        blend_toggles += stats.blend_toggles;
+    }
+};
+
+RenderStats render_stats;           // frame being drawn
+RenderStats last_frame_stats;       // last complete frame
+RenderStats total_render_stats;
+unsigned int rendered_frames = 0;
+
+// call after the frame's last GL call
+void endRenderStats() {
+    last_frame_stats = render_stats;
+    total_render_stats.add(render_stats);
+    rendered_frames++;
+    render_stats = RenderStats();
+}
+
+void reportRenderStats() {
+    if(rendered_frames == 0) {
+        return;
+    }
+    const RenderStats& t = total_render_stats;
+    double n = rendered_frames;
+    printf("per frame over %u frames: %.1f draw calls, %.1f program switches, %.1f vao binds, %.1f texture binds, "
+           "%.1f uniform uploads, %.1f blend toggles\n", rendered_frames, t.draw_calls / n, t.program_switches / n,
+           t.vao_binds / n, t.texture_binds / n, t.uniform_uploads / n, t.blend_toggles / n);
+}
+
 
 
 class GameObject {
     int type;
     vec2 position;
+    vec2 prev_position;     // position at the start of the current tick, for render interpolation
     float orientation;
     float rotation_rate;
     bool in_grid;
@@ -121,6 +423,7 @@ class GameObject {
     
 public:
     double scaling;
+    double prev_scaling;
     double removal_start_t;
     double removal_end_t;
 
@@ -129,10 +432,12 @@ public:
         type = _type;
         orientation = _orientation;
         position = _position;
+        prev_position = _position;
         rotation_rate = _rotation_rate;
         in_grid = false;
         in_motion = false;
         scaling = 1.0;
+        prev_scaling = 1.0;
     }
     
     int getType() {
@@ -143,11 +448,31 @@ public:
         return position;
     }
     
+    vec2 getPrevPosition() {
+        return prev_position;
+    }
+    
     void setPosition(vec2 _position) {
+        // an object starting to move has nothing to interpolate from
+        if(!in_motion) {
+            prev_position = _position;
+        }
         position = _position;
         in_motion = true;
     }
     
+    // jump to a position without interpolating, e.g. when following the mouse
+    void warpPosition(vec2 _position) {
+        prev_position = _position;
+        position = _position;
+        in_motion = true;
+    }
+    
+    void saveState() {
+        prev_position = position;
+        prev_scaling = scaling;
+    }
+    
     bool isInMotion() {
         return in_motion;
     }
@@ -228,6 +553,7 @@ public:
     
     void Run() {
         glUseProgram(shaderProgram);
+        render_stats.program_switches++;
     }
     
     virtual void UploadSamplerID() = 0;
@@ -269,6 +595,7 @@ public:
         int location = glGetUniformLocation(shaderProgram, "M");
         if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
         else printf("uniform M cannot be set\n");
+        render_stats.uniform_uploads++;
     }
     
     
@@ -361,6 +688,7 @@ public:
         int location = glGetUniformLocation(shaderProgram, "vertexColor");
         if (location >= 0) glUniform3fv(location, 1, &color.v[0]); // set uniform variable vertexColor
         else printf("uniform vertex color cannot be set\n");
+        render_stats.uniform_uploads++;
     }
 };
 
@@ -416,6 +744,7 @@ public:
         int location = glGetUniformLocation(shaderProgram, "samplerUnit");
         glUniform1i(location, samplerUnit);
         glActiveTexture(GL_TEXTURE0 + samplerUnit); 
+        render_stats.uniform_uploads++;
     }
     
     void UploadColor(vec4& color) {
@@ -435,6 +764,14 @@ public:
     }
     virtual void Draw() = 0;
     
+    // bind the vao and draw its first count vertices
+    void drawArrays(GLenum mode, int count) {
+        glBindVertexArray(vao);
+        glDrawArrays(mode, 0, count);
+        render_stats.vao_binds++;
+        render_stats.draw_calls++;
+    }
+    
 };
 
 
@@ -470,8 +807,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 18);
+        drawArrays(GL_TRIANGLE_STRIP, 18);
     }
 
 };
@@ -507,8 +843,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 18);
+        drawArrays(GL_TRIANGLE_STRIP, 18);
     }
     
 };
@@ -548,8 +883,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, num_of_steps*3);
+        drawArrays(GL_TRIANGLE_STRIP, num_of_steps*3);
     }
 
 };
@@ -588,8 +922,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, num_of_steps*3);
+        drawArrays(GL_TRIANGLE_STRIP, num_of_steps*3);
     }
     
 };
@@ -616,8 +949,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-        glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
+        drawArrays(GL_TRIANGLES, 3); // draw a single triangle with vertices defined in vao
     }
     
 };
@@ -642,8 +974,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        drawArrays(GL_TRIANGLE_STRIP, 4);
     }
     
 };
@@ -672,9 +1003,9 @@ public:
     {
         glEnable(GL_BLEND); // necessary for transparent pixels
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao); 
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4); 
+        drawArrays(GL_TRIANGLE_STRIP, 4); 
         glDisable(GL_BLEND);
+        render_stats.blend_toggles += 2;
     }
 };
 
@@ -699,8 +1030,7 @@ public:
     
     void Draw()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        drawArrays(GL_TRIANGLE_STRIP, 4);
     }
     
 };
@@ -733,6 +1063,7 @@ public:
     void Bind()
     {
         glBindTexture(GL_TEXTURE_2D, textureId);
+        render_stats.texture_binds++;
     }
 };
 
@@ -772,7 +1103,7 @@ public:
             shader->UploadColor(color1);
         }
         else {
-            float theta = time_glob*rate;
+            float theta = render_time_glob*rate;
             vec4 color_combo = vec4(cos(theta)*color1.v[0] +(1-cos(theta))*color2.v[0], cos(theta)*color1.v[1] +(1-cos(theta))*color2.v[1], cos(theta)*color1.v[2] +(1-cos(theta))*color2.v[2]);
             shader->UploadColor(color_combo);
         }
@@ -836,7 +1167,7 @@ public:
                       0.0, 0.0, 1.0, 0.0,
                       0.0, 0.0, 0.0, 1.0);
         
-        float alpha = (orientation + time_glob * rotation_rate) / 180.0 * M_PI;
+        float alpha = (orientation + render_time_glob * rotation_rate) / 180.0 * M_PI;
         
         mat4 R = mat4(
                       cos(alpha), sin(alpha), 0.0, 0.0,
@@ -890,502 +1221,4559 @@ public:
 };
 
 
-
-class Scene {
-    std::vector<Shader*> shaders;
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-    std::vector<Object*> objects;
-    std::vector<GameObject> gameObjects;
-
+// small seedable generator (splitmix64), so board outcomes can be reproduced from a seed
+class GemRng {
+    unsigned long long state;
 public:
-    std::vector<std::vector<GameObject*>> grid;
-    int gem_types;
-    int num_of_rows = 10;
-    int num_of_cols = 10;
+    GemRng(unsigned long long seed = 0) {
+        state = seed;
+    }
     
-    std::vector<Movement*> movements;
-    std::vector<Removal*> removals;
+    unsigned long long next() {
+        unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
     
-    Scene() {
-        Initialize();
+    // uniform in [0, n)
+    int below(int n) {
+        return (int)(((next() >> 32) * (unsigned long long)n) >> 32);
     }
     
-    void Initialize() {
-        
-        
-        shaders.push_back(new StandardShader());
-        shaders.push_back(new TexturedShader());
-        
-        materials.push_back(new Material(shaders[0], vec4(1, 0, 0), vec4(1, 0.078,0.576), 8));
-        materials.push_back(new Material(shaders[0], vec4(1, 1, 0)));
-        materials.push_back(new Material(shaders[0], vec4(0.5, 1, 0), vec4(0,1,0.5), 4));
-        materials.push_back(new Material(shaders[0], vec4(0.25, 0, 1), vec4(0,0.25,1), 5));
-        materials.push_back(new Material(shaders[0], vec4(0.5, 0.25, 1), vec4(0.5, 0, 1), 6));
-        materials.push_back(new Material(shaders[0], vec4(1, 0.5, 0)));
-        materials.push_back(new Material(shaders[1], vec4(), new Texture("asteroidtexturepack/asteroid3.png")));
-        materials.push_back(new Material(shaders[1], vec4(), new Texture("asteroidtexturepack/asteroid2.png")));
+    // GemRng(getState()) continues the same sequence
+    unsigned long long getState() const {
+        return state;
+    }
+};
 
-        
-        geometries.push_back(new Heart());
-        geometries.push_back(new Star());
-        geometries.push_back(new Triangle());
-        geometries.push_back(new Quad());
-        geometries.push_back(new Pent());
-        geometries.push_back(new Diamond());
-        geometries.push_back(new TexturedQuad());
-        geometries.push_back(new TexturedQuad());
-        
-        
-        for (int i = 0; i < materials.size() && i < geometries.size(); i++) {
-            meshes.push_back(new Mesh(geometries[i], materials[i]));
-        }
-        gem_types = meshes.size();
-        
-        InitializeGrid();
-        
-        UpdateGrid();
-        
+// raw values in host byte order in and out of the binary snapshots
+template<typename T>
+void putBytes(std::vector<unsigned char>& out, const T& value) {
+    const unsigned char* bytes = (const unsigned char*)&value;
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template<typename T>
+bool getBytes(const unsigned char*& in, const unsigned char* end, T& value) {
+    if(end - in < (long)sizeof(T)) {
+        return false;
     }
-    ~Scene() {
-        for(int i = 0; i < materials.size(); i++) delete materials[i];
-        for(int i = 0; i < geometries.size(); i++) delete geometries[i];
-        for(int i = 0; i < meshes.size(); i++) delete meshes[i];
-        for(int i = 0; i < objects.size(); i++) delete objects[i];
-        for(int i = 0; i < shaders.size(); i++) delete shaders[i];
-        
+    memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return true;
+}
+
+
+struct Move {
+    int i1, j1;
+    int i2, j2;
+    
+    Move(int _i1 = 0, int _j1 = 0, int _i2 = 0, int _j2 = 0) {
+        i1 = _i1; j1 = _j1;
+        i2 = _i2; j2 = _j2;
+    }
+};
+
+// what one swap led to once the board came to rest
+struct CascadeResult {
+    int cleared;        // gems removed over the whole cascade
+    int chain;          // number of clearing rounds
+    int specials;       // runs longer than three
+    
+    CascadeResult() {
+        cleared = 0;
+        chain = 0;
+        specials = 0;
     }
     
-    void InitializeGrid() {
-        for(int i = 0; i < num_of_cols*num_of_rows; i++) {
-            addRandomGameObject();
+    int score() const {
+        return cleared + 5*(chain - 1) + 10*specials;
+    }
+};
+
+
+class Board;
+
+// decides the gem type of each cell a refill spawns. the refill goes column by column from the left and
+// bottom up within a column, so when (i, j) is asked for everything below it and every column left of
+// it is already filled, while cells above it and columns to its right may still be empty. from is the
+// lowest row the refill spawns in column i, so j == from for the first new gem of the column
+class SpawnPolicy {
+public:
+    virtual ~SpawnPolicy() {}
+    virtual int spawn(const Board& board, int i, int j, int from, GemRng& rng) = 0;
+    // start over for a new game; policies without state have nothing to do
+    virtual void rewind() {}
+};
+
+
+// plain copyable board of gem types for solvers and tools: no GL, no animation.
+// indexed like Scene::grid, cell (i, j) is column i, row j, and gems fall towards row 0.
+// per-column bookkeeping of the lowest changed row keeps cascades local to where gems actually moved,
+// so resolving a swap on a big board costs what the cascade touches rather than the board size
+class Board {
+    std::vector<signed char> cells;     // gem type, or EMPTY
+    std::vector<int> dirty_from;        // lowest row per column not yet checked for runs
+    std::vector<int> hole_from;         // lowest empty row per column not yet collapsed
+    std::vector<int> touched_from;      // lowest row per column changed since the board was last at rest
+    std::vector<int> to_clear;          // scratch for clearMatches
+    std::vector<unsigned int> spawned;  // gems drawn so far from each column's spawn stream
+    unsigned long long zobrist;         // xor of zobristKey over all cells and spawnKey over all columns
+    
+    // write one cell, keeping the hash in step
+    void put(int k, int gem_type) {
+        zobrist ^= zobristKey(k, cells[k]) ^ zobristKey(k, gem_type);
+        cells[k] = gem_type;
+    }
+    
+    // recompute the hash after cells were written raw
+    void rehash() {
+        zobrist = 0;
+        for(int k = 0; k < (int)cells.size(); k++) {
+            zobrist ^= zobristKey(k, cells[k]);
         }
-        for(int i = 0; i < num_of_rows; i++) {
-            std::vector<GameObject*> row;
-            for(int j = 0; j < num_of_cols; j++) {
-                row.push_back(&gameObjects[i+10*j]);
-                row.at(j)->set_in_grid(true);
-                vec2 cell = vec2(i,j);
-                movements.push_back(new Movement(cell,grid_to_coords(vec2(i,j+10)), grid_to_coords(cell), time_glob, time_glob + 3*move_time));
-                gameObjects[i+10*j].setPosition(grid_to_coords(vec2(i,j+10)));
-            }
-            grid.push_back(row);
+        for(int i = 0; i < num_of_cols; i++) {
+            zobrist ^= spawnKey(i, spawned[i]);
         }
-        //skyfall();
     }
     
-    void addRandomGameObject() {
-        int gem_type = rand()%gem_types;
-        int rotation_rate = 0;
-        if(gem_type == 1) {rotation_rate = 10;}
-        if(gem_type == 6) {rotation_rate = 40;}
-        if(gem_type == 7) {rotation_rate = -20;}
-        gameObjects.push_back(GameObject(gem_type, vec2(0,0), 0, rotation_rate));
+    void changed(int i, int j) {
+        if(j < dirty_from[i]) dirty_from[i] = j;
+        if(j < touched_from[i]) touched_from[i] = j;
     }
     
-    void UpdateGrid() {
-        objects.clear();
-        for(int i = 0; i < grid.size(); i++) {
-            for(int j = 0; j < grid[0].size(); j++) {
-                GameObject* gameObject = grid.at(i).at(j);
-                if(gameObject != nullptr) {
-                    int gem_type = gameObject->getType();
-                    vec2 position = grid_to_coords(vec2(i, j));
-                    bool draw_last = false;
-                    if(gameObject->isInMotion()) {
-                        position = gameObject->getPosition();
-                        draw_last = true;
-                    }
-                    objects.push_back(new Object(meshes[gem_type], position, draw_last, vec2(gameObject->scaling/num_of_rows, gameObject->scaling/num_of_cols), gameObject->getOrientation(), gameObject->getRotationRate()));
+    // for shuffle: empty cell (i, j) fits none of the remaining gems, so it takes the gem of an earlier cell
+    // that one of them can replace without completing a run there
+    bool trade(int i, int j, std::vector<int>& count, const int* shape) {
+        int k = i*num_of_rows + j;
+        for(int t = 0; t < gem_types; t++) {
+            if(count[t] == 0) {
+                continue;
+            }
+            for(int d = 0; d < k; d++) {
+                int u = cells[d];
+                if(u == t || d == shape[0] || d == shape[1] || d == shape[2]) {
+                    continue;
+                }
+                int di = d / num_of_rows, dj = d % num_of_rows;
+                cells[d] = EMPTY;
+                bool fits = !completesRun(i, j, u);
+                cells[k] = u;
+                if(fits && !completesRun(di, dj, t)) {
+                    cells[d] = t;
+                    count[t]--;
+                    return true;
                 }
+                cells[k] = EMPTY;
+                cells[d] = u;
             }
         }
-        for (int i = 0; i < removals.size(); i++) {
-            GameObject* gameObject = removals[i]->gameObject;
-            if(gameObject != nullptr) {
-                int gem_type = gameObject->getType();
-                vec2 position = gameObject->getPosition();
-                objects.push_back(new Object(meshes[gem_type], position, true, vec2(gameObject->scaling/num_of_rows, gameObject->scaling/num_of_cols), gameObject->getOrientation(), gameObject->getRotationRate()));
-            }
+        return false;
+    }
+    
+public:
+    // packed boards hold a gem in a nibble and keep 15 for EMPTY
+    enum { EMPTY = -1, max_gem_types = 15 };
+    
+    // random key per (cell, gem type). derived by hashing instead of looked up in a table, so boards
+    // of any size share it without allocation; an empty cell contributes nothing
+    static unsigned long long zobristKey(int k, int gem_type) {
+        if(gem_type == EMPTY) {
+            return 0;
+        }
+        GemRng mix((unsigned long long)k * 16 + gem_type);
+        return mix.next();
+    }
+    
+    static unsigned long long spawnKey(int i, unsigned int n) {
+        if(n == 0) {
+            return 0;
         }
+        GemRng mix(~(((unsigned long long)i << 32) | n));
+        return mix.next();
     }
     
+    // seed of the per-column spawn streams used by refillFromStreams
+    unsigned long long spawn_seed;
     
-    vec2 coords_to_grid(vec2 loc) {
-        int i = (int)((loc.x + 1)*5);
-        int j = (int)((loc.y + 1)*5);
-        return vec2(i,j);
+    int num_of_cols;
+    int num_of_rows;
+    int gem_types;
+    
+    Board(int _num_of_cols = 0, int _num_of_rows = 0, int _gem_types = 0) {
+        num_of_cols = _num_of_cols;
+        num_of_rows = _num_of_rows;
+        gem_types = _gem_types;
+        cells.assign(num_of_cols*num_of_rows, EMPTY);
+        spawned.assign(num_of_cols, 0);
+        spawn_seed = 0;
+        zobrist = 0;
+        dirty_from.assign(num_of_cols, 0);
+        hole_from.assign(num_of_cols, 0);
+        touched_from.assign(num_of_cols, 0);
     }
     
-    vec2 grid_to_coords(vec2 cell) {
-        double x = cell.x/5.0-0.9;
-        double y = cell.y/5.0-0.9;
-        return vec2(x,y);
+    // empty again as constructed, keeping the storage
+    void clear() {
+        std::fill(cells.begin(), cells.end(), (signed char)EMPTY);
+        std::fill(spawned.begin(), spawned.end(), 0u);
+        spawn_seed = 0;
+        zobrist = 0;
+        std::fill(dirty_from.begin(), dirty_from.end(), 0);
+        std::fill(hole_from.begin(), hole_from.end(), 0);
+        std::fill(touched_from.begin(), touched_from.end(), 0);
     }
     
+    int at(int i, int j) const {
+        return cells[i*num_of_rows + j];
+    }
     
-    void Draw()
-    {
-        // draw objects with overriden position
-        std::vector<Object*> objects_to_draw_last;
-        for(int i = 0; i < objects.size(); i++) {
-            if(objects[i]->shouldDrawLast()) {
-                objects_to_draw_last.push_back(objects[i]);
-            }
-            else {
-                objects[i]->Draw();
-            }
-        }
-        for(int i = 0; i < objects_to_draw_last.size(); i++) {
-            objects_to_draw_last[i]->Draw();
+    // same position, same hash, whatever order of moves led to it
+    unsigned long long hash() const {
+        return zobrist;
+    }
+    
+    void set(int i, int j, int gem_type) {
+        put(i*num_of_rows + j, gem_type);
+        changed(i, j);
+        if(gem_type == EMPTY && j < hole_from[i]) {
+            hole_from[i] = j;
         }
     }
     
+    void swap(int i1, int j1, int i2, int j2) {
+        signed char temp = cells[i1*num_of_rows + j1];
+        put(i1*num_of_rows + j1, cells[i2*num_of_rows + j2]);
+        put(i2*num_of_rows + j2, temp);
+        changed(i1, j1);
+        changed(i2, j2);
+    }
     
-    void swap(vec2 cell1, vec2 cell2) {
-        GameObject* temp = grid[cell1.x][cell1.y];
-        grid[cell1.x][cell1.y] = grid[cell2.x][cell2.y];
-        grid[cell2.x][cell2.y] = temp;
+    // declare the board at rest: nothing to check, nothing to collapse, nothing to restore
+    void markClean() {
+        for(int i = 0; i < num_of_cols; i++) {
+            dirty_from[i] = num_of_rows;
+            hole_from[i] = num_of_rows;
+            touched_from[i] = num_of_rows;
+        }
     }
     
-    bool isLegalMove(vec2 cell1, vec2 cell2) {
-        swap(cell1, cell2);
+    // undo everything since the board was last at rest by copying back only the touched columns of
+    // original, which must be that resting board. much cheaper than a full copy on big boards
+    void restore(const Board& original) {
         for(int i = 0; i < num_of_cols; i++) {
-            for(int j = 0; j < num_of_rows; j++) {
-                if(grid[i][j] != nullptr) {
-                    int x = i + 1;
-                    while(x < num_of_cols) {
-                        if(grid[x][j] == nullptr || grid[i][j]->getType() != grid[x][j]->getType()) {
-                            break;
-                        }
-                        x++;
-                    }
-                    if(x-i >= 3) {
-                        swap(cell1, cell2);
-                        return true;
-                    }
-                    int y = j + 1;
-                    while(y < num_of_cols) {
-                        if(grid[i][y] == nullptr || grid[i][j]->getType() != grid[i][y]->getType()) {
-                            break;
-                        }
-                        y++;
-                    }
-                    if(y-j >= 3) {
-                        swap(cell1, cell2);
-                        return true;
-                    }
+            int j = touched_from[i];
+            if(j < num_of_rows) {
+                memcpy(&cells[i*num_of_rows + j], &original.cells[i*num_of_rows + j], num_of_rows - j);
+                spawned[i] = original.spawned[i];
+            }
+            dirty_from[i] = num_of_rows;
+            hole_from[i] = num_of_rows;
+            touched_from[i] = num_of_rows;
+        }
+        zobrist = original.zobrist;
+    }
+    
+    // true if the gem at (i, j) is part of a horizontal or vertical run of three or more
+    bool matchesAt(int i, int j) const {
+        int gem_type = at(i, j);
+        if(gem_type == EMPTY) {
+            return false;
+        }
+        int run = 1;
+        for(int x = i - 1; x >= 0 && at(x, j) == gem_type; x--) run++;
+        for(int x = i + 1; x < num_of_cols && at(x, j) == gem_type; x++) run++;
+        if(run >= 3) {
+            return true;
+        }
+        run = 1;
+        for(int y = j - 1; y >= 0 && at(i, y) == gem_type; y--) run++;
+        for(int y = j + 1; y < num_of_rows && at(i, y) == gem_type; y++) run++;
+        return run >= 3;
+    }
+    
+    // a swap is legal if it makes a run through one of the two swapped cells; only those can change
+    bool isLegalMove(const Move& m) {
+        int a = at(m.i1, m.j1);
+        int b = at(m.i2, m.j2);
+        if(a == b || a == EMPTY || b == EMPTY) {
+            return false;
+        }
+        cells[m.i1*num_of_rows + m.j1] = b;
+        cells[m.i2*num_of_rows + m.j2] = a;
+        bool legal = matchesAt(m.i1, m.j1) || matchesAt(m.i2, m.j2);
+        cells[m.i1*num_of_rows + m.j1] = a;
+        cells[m.i2*num_of_rows + m.j2] = b;
+        return legal;
+    }
+    
+    bool holds(int i, int j, int gem_type) const {
+        return i >= 0 && i < num_of_cols && j >= 0 && j < num_of_rows && at(i, j) == gem_type;
+    }
+    
+    // true if the gem t at (i, j) starts one of the few shapes a legal swap needs: two in a line with a
+    // third one step off either end, or two with a gap and a third beside the gap. cells are read
+    // through holds(x, y, t), so callers can look at a board with a cell changed
+    template<typename Holds>
+    static bool moveShapeAt(const Holds& holds, int i, int j, int t) {
+        if(holds(i + 1, j, t) && (holds(i - 2, j, t) || holds(i - 1, j - 1, t) || holds(i - 1, j + 1, t) ||
+                                  holds(i + 3, j, t) || holds(i + 2, j - 1, t) || holds(i + 2, j + 1, t))) {
+            return true;
+        }
+        if(holds(i + 2, j, t) && (holds(i + 1, j - 1, t) || holds(i + 1, j + 1, t))) {
+            return true;
+        }
+        if(holds(i, j + 1, t) && (holds(i, j - 2, t) || holds(i - 1, j - 1, t) || holds(i + 1, j - 1, t) ||
+                                  holds(i, j + 3, t) || holds(i - 1, j + 2, t) || holds(i + 1, j + 2, t))) {
+            return true;
+        }
+        return holds(i, j + 2, t) && (holds(i - 1, j + 1, t) || holds(i + 1, j + 1, t));
+    }
+    
+    // true if a board at rest has a legal swap, found by shape instead of by trying every swap
+    bool hasLegalMove() const {
+        auto cell = [this](int x, int y, int t) { return holds(x, y, t); };
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                int t = at(i, j);
+                if(t != EMPTY && moveShapeAt(cell, i, j, t)) {
+                    return true;
                 }
             }
         }
-        swap(cell1, cell2);
         return false;
     }
     
+    // true if gem type t at (i, j) would start or complete a move shape; looks only at the cells a shape
+    // through (i, j) can reach
+    bool formsMove(int i, int j, int t) const {
+        auto cell = [this, i, j, t](int x, int y, int u) { return x == i && y == j ? u == t : holds(x, y, u); };
+        for(int x = std::max(0, i - 3); x <= std::min(num_of_cols - 1, i + 3); x++) {
+            for(int y = std::max(0, j - 3); y <= std::min(num_of_rows - 1, j + 3); y++) {
+                if(cell(x, y, t) && moveShapeAt(cell, x, y, t)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
     
-    bool removeLines() {
-        bool lines_found = false;
+    // true if gem type t at (i, j) would complete a run of three with its neighbours
+    bool completesRun(int i, int j, int t) const {
+        int run = 1;
+        for(int x = i - 1; holds(x, j, t); x--) run++;
+        for(int x = i + 1; holds(x, j, t); x++) run++;
+        if(run >= 3) {
+            return true;
+        }
+        run = 1;
+        for(int y = j - 1; holds(i, y, t); y--) run++;
+        for(int y = j + 1; holds(i, y, t); y++) run++;
+        return run >= 3;
+    }
+    
+    // every legal swap with the right or upper neighbour
+    void legalMoves(std::vector<Move>& moves) {
+        moves.clear();
         for(int i = 0; i < num_of_cols; i++) {
             for(int j = 0; j < num_of_rows; j++) {
-                if(grid[i][j] != nullptr) {
-                    int x = i + 1;
-                    while(x < num_of_cols) {
-                        if(grid[x][j] == nullptr || grid[i][j]->getType() != grid[x][j]->getType()) {
-                            break;
-                        }
-                        x++;
-                    }
-                    if(x-i >= 3) {
-                        lines_found = true;
-                        for (int a = i; a < x; a++) {
-                            remove_cell(vec2(a,j));
-                        }
-                    }
-                    int y = j + 1;
-                    while(y < num_of_cols) {
-                        if(grid[i][y] == nullptr || grid[i][j]->getType() != grid[i][y]->getType()) {
-                            break;
-                        }
-                        y++;
-                    }
-                    if(y-j >= 3) {
-                        lines_found = true;
-                        for (int b = j; b < y; b++) {
-                            remove_cell(vec2(i,b));
-                        }
-                    }
+                if(i + 1 < num_of_cols && isLegalMove(Move(i, j, i + 1, j))) {
+                    moves.push_back(Move(i, j, i + 1, j));
+                }
+                if(j + 1 < num_of_rows && isLegalMove(Move(i, j, i, j + 1))) {
+                    moves.push_back(Move(i, j, i, j + 1));
                 }
             }
         }
-        if(lines_found) {
-            for(int i = 0; i < num_of_cols; i++) {
-                for(int j = 0; j < num_of_rows; j++) {
-                    if(grid[i][j] != nullptr && !grid[i][j]->is_in_grid()) {
-                        grid[i][j] = nullptr;
-                    }
-                }
+    }
+    
+    enum { snapshot_version = 1 };
+    
+    size_t snapshotSize() const {
+        return 22 + 4*num_of_cols + (cells.size() + 1)/2;
+    }
+    
+    // compact image of a board at rest, written to out[snapshotSize()] in host byte order: u8 version,
+    // u8 gem_types, u16 cols, u16 rows, u64 spawn_seed, u64 hash, u32 spawned[cols], then the cells two
+    // to a byte, low nibble first, 15 for EMPTY. gem_types must be at most 15
+    void save(unsigned char* out) const {
+        unsigned short cols = num_of_cols, rows = num_of_rows;
+        out[0] = snapshot_version;
+        out[1] = gem_types;
+        memcpy(out + 2, &cols, 2);
+        memcpy(out + 4, &rows, 2);
+        memcpy(out + 6, &spawn_seed, 8);
+        memcpy(out + 14, &zobrist, 8);
+        memcpy(out + 22, &spawned[0], 4*num_of_cols);
+        unsigned char* packed = out + 22 + 4*num_of_cols;
+        int n = cells.size();
+        for(int k = 0; k + 1 < n; k += 2) {
+            packed[k/2] = (cells[k] & 15) | (cells[k + 1] & 15) << 4;
+        }
+        if(n % 2) {
+            packed[n/2] = cells[n - 1] & 15;
+        }
+    }
+    
+    // restore a snapshot written by save; storage is only reallocated if the size changed. returns false
+    // and leaves the board alone if the data is not a snapshot this version can read: a cell that is
+    // neither EMPTY nor one of the gem types, or a hash that does not match the cells it came with
+    bool load(const unsigned char* in, size_t size) {
+        unsigned short cols, rows;
+        if(size < 22 || in[0] != snapshot_version || in[1] > max_gem_types) {
+            return false;
+        }
+        memcpy(&cols, in + 2, 2);
+        memcpy(&rows, in + 4, 2);
+        int n = cols*rows;
+        if(cols == 0 || rows == 0 || size < 22 + 4*(size_t)cols + (n + 1)/2) {
+            return false;
+        }
+        int types = in[1];
+        unsigned long long stored;
+        memcpy(&stored, in + 14, 8);
+        const unsigned char* packed = in + 22 + 4*cols;
+        // nibble 15 wraps round to EMPTY
+        unsigned long long hash = 0;
+        for(int k = 0; k < n; k++) {
+            int gem_type = (((packed[k/2] >> (k % 2 ? 4 : 0)) + 1) & 15) - 1;
+            if(gem_type >= types) {
+                return false;
             }
+            hash ^= zobristKey(k, gem_type);
         }
-        return lines_found;
+        for(int i = 0; i < cols; i++) {
+            unsigned int count;
+            memcpy(&count, in + 22 + 4*i, 4);
+            hash ^= spawnKey(i, count);
+        }
+        if(hash != stored) {
+            return false;
+        }
+        
+        if(cols != num_of_cols || rows != num_of_rows) {
+            *this = Board(cols, rows, types);
+        }
+        gem_types = types;
+        memcpy(&spawn_seed, in + 6, 8);
+        memcpy(&spawned[0], in + 22, 4*cols);
+        signed char* c = &cells[0];
+        for(int k = 0; k + 1 < n; k += 2) {
+            c[k] = ((packed[k/2] + 1) & 15) - 1;
+            c[k + 1] = (((packed[k/2] >> 4) + 1) & 15) - 1;
+        }
+        if(n % 2) {
+            c[n - 1] = ((packed[n/2] + 1) & 15) - 1;
+        }
+        zobrist = hash;
+        markClean();
+        return true;
     }
     
-    void remove_cell(vec2 cell) {
-        grid[cell.x][cell.y]->setPosition(grid_to_coords(vec2(cell.x,cell.y)));
-        removals.push_back(new Removal(grid[cell.x][cell.y], time_glob, time_glob+remove_time));
-        grid[cell.x][cell.y]->set_in_grid(false);
-
+    // fill the whole board at rest: each cell is drawn again while it would complete a run with the
+    // two cells left of it or below it, and boards without a legal swap are drawn again. cells are
+    // written raw and the hash is rebuilt once for the board that is kept. returns the number of
+    // boards drawn, or 0 when no board with a legal swap turned up in max_draws draws, or with fewer
+    // than three gem types where a run cannot always be avoided; the board is then not at rest
+    enum { max_draws = 1000 };
+    int generate(GemRng& rng) {
+        if(gem_types < 3) {
+            return 0;
+        }
+        // locals, so the stores into the cells do not force the compiler to reload them
+        GemRng local = rng;
+        const int cols = num_of_cols, rows = num_of_rows, types = gem_types;
+        signed char* c = &cells[0];
+        unsigned long long bits = 0;
+        int bits_left = 0;
+        int attempts = 0;
+        bool legal;
+        do {
+            attempts++;
+            for(int i = 0; i < cols; i++) {
+                signed char* column = c + i*rows;
+                // the two cells below, kept in registers instead of read back from memory
+                int below1 = EMPTY, below2 = EMPTY;
+                for(int j = 0; j < rows; j++) {
+                    int lo = (i >= 2 && column[j - rows] == column[j - 2*rows]) ? column[j - rows] : EMPTY;
+                    int hi = below1 == below2 ? below1 : EMPTY;
+                    // rejection keeps the draw uniform over the allowed types and rarely loops;
+                    // each 64 bit draw feeds four cells
+                    int gem_type;
+                    do {
+                        if(bits_left == 0) {
+                            bits = local.next();
+                            bits_left = 4;
+                        }
+                        gem_type = (int)(((bits & 0xFFFF) * types) >> 16);
+                        bits >>= 16;
+                        bits_left--;
+                    } while(gem_type == lo || gem_type == hi);
+                    column[j] = gem_type;
+                    below2 = below1;
+                    below1 = gem_type;
+                }
+            }
+            legal = hasLegalMove();
+        } while(!legal && attempts < max_draws);
+        rng = local;
+        rehash();
+        markClean();
+        return legal ? attempts : 0;
     }
     
-    // return -1 if no cells to destroy, 1 if last cell destroyed, and >1 otherwise
-    int processRemovals() {
-        int object_destroyed = 0;
-        int object_shrunk = 0;
-        if(removals.size() != 0) {
-            for(int i = 0; i < removals.size(); i++) {
-                Removal* r = removals[i];
-                GameObject* gameObject = r->gameObject;
-                if(gameObject != nullptr) {
-                    if (time_glob >= r->start_t && time_glob <= r->end_t) {
-                        double scaling = (r->end_t - time_glob)/(r->end_t - r->start_t);
-                        gameObject->scaling = scaling;
-                        object_shrunk = 2;
-                    } else if( time_glob > r->end_t ){
-                        removals.erase(removals.begin() + i);
-                        i--;
-                        object_destroyed = 1;
+    // deal the gems already on a full board out again so that no run remains and a legal swap exists.
+    // constructive instead of retrying until lucky: a move shape of a type with three or more gems is
+    // planted first, then the other cells are filled in one pass, each with the most plentiful remaining
+    // type that completes no run. a cell left with only run-completing gems trades with an earlier cell.
+    // O(cells * gem_types) apart from those rare trades. returns false and leaves the board as it was
+    // when no layout can have a move: no type has three gems, or the board is narrower than a shape
+    bool shuffle(GemRng& rng) {
+        bool horizontal = num_of_cols >= 3 && num_of_rows >= 2;
+        bool vertical = num_of_rows >= 3 && num_of_cols >= 2;
+        if(!horizontal && !vertical) {
+            return false;
+        }
+        if(horizontal && vertical) {
+            horizontal = rng.below(2) == 0;
+        }
+        std::vector<int> count(gem_types, 0);
+        int plentiful = 0;
+        for(int k = 0; k < (int)cells.size(); k++) {
+            if(cells[k] != EMPTY && ++count[cells[k]] == 3) {
+                plentiful++;
+            }
+        }
+        if(plentiful == 0) {
+            return false;
+        }
+        std::vector<signed char> original = cells;
+        
+        // the shape: two in a line and a third one step off the end, swapped in through cell (sx, sy)
+        int planted_type = -1;
+        for(int n = rng.below(plentiful); n >= 0; n--) {
+            do planted_type++; while(count[planted_type] < 3);
+        }
+        int x = rng.below(num_of_cols - (horizontal ? 2 : 1));
+        int y = rng.below(num_of_rows - (horizontal ? 1 : 2));
+        int shape[3];
+        if(horizontal) {
+            shape[0] = x*num_of_rows + y;
+            shape[1] = (x + 1)*num_of_rows + y;
+            shape[2] = (x + 2)*num_of_rows + y + 1;
+        }
+        else {
+            shape[0] = x*num_of_rows + y;
+            shape[1] = x*num_of_rows + y + 1;
+            shape[2] = (x + 1)*num_of_rows + y + 2;
+        }
+        for(int k = 0; k < (int)cells.size(); k++) {
+            cells[k] = EMPTY;
+        }
+        for(int s = 0; s < 3; s++) {
+            cells[shape[s]] = planted_type;
+        }
+        count[planted_type] -= 3;
+        
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                int k = i*num_of_rows + j;
+                if(cells[k] != EMPTY) {
+                    continue;
+                }
+                // ties between equally plentiful types go to a random one
+                int best = EMPTY;
+                int first = rng.below(gem_types);
+                for(int n = 0; n < gem_types; n++) {
+                    int t = (first + n) % gem_types;
+                    if(count[t] > 0 && (best == EMPTY || count[t] > count[best]) && !completesRun(i, j, t)) {
+                        best = t;
                     }
                 }
+                if(best == EMPTY && !trade(i, j, count, shape)) {
+                    cells = original;
+                    return false;
+                }
+                if(best != EMPTY) {
+                    cells[k] = best;
+                    count[best]--;
+                }
             }
-            return removals.size();
         }
-        return -1;
+        rehash();
+        markClean();
+        return true;
     }
     
-    int processMovements() {
-        if(movements.size() != 0) {
-            for(int i = 0; i < movements.size(); i++) {
-                Movement* movement = movements[i];
-                if(movement->start_t == -1) {
-                    movement->start_t = time_glob;
-                    movement->end_t = time_glob + move_time;
+    
+    // remove every run of three or more that goes through a changed cell, all at once like
+    // Scene::removeLines; return gems removed
+    int clearMatches(CascadeResult& result) {
+        to_clear.clear();
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = dirty_from[i]; j < num_of_rows; j++) {
+                int gem_type = at(i, j);
+                if(gem_type == EMPTY) {
+                    continue;
                 }
-                if(time_glob >= movement->start_t && time_glob <= movement->end_t) {
-                    move_object(movement, time_glob);
+                int left = i, right = i;
+                while(left > 0 && at(left - 1, j) == gem_type) left--;
+                while(right + 1 < num_of_cols && at(right + 1, j) == gem_type) right++;
+                int bottom = j, top = j;
+                while(bottom > 0 && at(i, bottom - 1) == gem_type) bottom--;
+                while(top + 1 < num_of_rows && at(i, top + 1) == gem_type) top++;
+                
+                // a run is seen from each of its changed cells, only its first changed cell reports it
+                if(right - left >= 2) {
+                    int first = left;
+                    while(j < dirty_from[first]) first++;
+                    if(first == i) {
+                        if(right - left > 2) result.specials++;
+                        for(int a = left; a <= right; a++) to_clear.push_back(a*num_of_rows + j);
+                    }
+                }
+                if(top - bottom >= 2 && j == std::max(bottom, dirty_from[i])) {
+                    if(top - bottom > 2) result.specials++;
+                    for(int b = bottom; b <= top; b++) to_clear.push_back(i*num_of_rows + b);
                 }
-                else if(time_glob > movement->end_t) {
-                    if(grid[movement->cell.x][movement->cell.y] != nullptr) {
-                        stop_motion(movement->cell);
+            }
+        }
+        for(int i = 0; i < num_of_cols; i++) {
+            dirty_from[i] = num_of_rows;
+        }
+        
+        int cleared = 0;
+        for(int k = 0; k < (int)to_clear.size(); k++) {
+            int i = to_clear[k] / num_of_rows;
+            int j = to_clear[k] % num_of_rows;
+            // runs crossing each other share a cell
+            if(at(i, j) != EMPTY) {
+                set(i, j, EMPTY);
+                cleared++;
+            }
+        }
+        if(cleared > 0) {
+            result.cleared += cleared;
+            result.chain++;
+        }
+        return cleared;
+    }
+    
+    // drop gems into the holes below them, like Scene::skyfall
+    void collapse() {
+        for(int i = 0; i < num_of_cols; i++) {
+            int from = hole_from[i];
+            if(from >= num_of_rows) {
+                continue;
+            }
+            int base = i*num_of_rows;
+            int bottom = from;
+            for(int j = from; j < num_of_rows; j++) {
+                if(cells[base + j] != EMPTY) {
+                    if(bottom != j) {
+                        put(base + bottom, cells[base + j]);
                     }
-                    movements.erase(movements.begin() + i);
-                    delete movement;
+                    bottom++;
                 }
             }
-            if(movements.size() == 0) {
-                removeLines();
+            for(int j = bottom; j < num_of_rows; j++) {
+                put(base + j, EMPTY);
             }
-            return movements.size();
+            changed(i, from);
+            // everything left empty is now at the top of the column
+            hole_from[i] = bottom;
         }
-        return -1;
     }
     
-    void processQuake() {
-        for(int i = 0; i < grid.size(); i++) {
-            for(int j = 0; j < grid[0].size(); j++) {
-                if(grid.at(i).at(j) != nullptr && rand()%1000 == 0 ) {
-                    remove_cell(vec2(i,j));
-                    grid[i][j] = nullptr;
+    // fill the holes at the top of every column with random gems, like Scene::fillgrid
+    void refill(GemRng& rng) {
+        for(int i = 0; i < num_of_cols; i++) {
+            int from = hole_from[i];
+            for(int j = from; j < num_of_rows; j++) {
+                if(at(i, j) == EMPTY) {
+                    put(i*num_of_rows + j, rng.below(gem_types));
+                    changed(i, j);
                 }
             }
+            hole_from[i] = num_of_rows;
         }
     }
     
-    void skyfall() {
+    void refill(GemRng& rng, SpawnPolicy& policy) {
         for(int i = 0; i < num_of_cols; i++) {
-            for(int j = 0; j < num_of_rows-1; j++) {
-                if(grid[i][j] == nullptr) {
-                    int y = j+1;
-                    while (y < num_of_rows && grid[i][y] == nullptr) {
-                        y++;
-                    }
-                    if(y < num_of_rows) {
-                        swap(vec2(i,j), vec2(i,y));
-                        movements.push_back(new Movement(vec2(i,j), grid_to_coords(vec2(i,y)), grid_to_coords(vec2(i,j)), -1, -1));
-                        set_cell_position(vec2(i,j), grid_to_coords(vec2(i,y)));
-                    }
+            int lowest = -1;
+            for(int j = hole_from[i]; j < num_of_rows; j++) {
+                if(at(i, j) == EMPTY) {
+                    if(lowest < 0) lowest = j;
+                    put(i*num_of_rows + j, policy.spawn(*this, i, j, lowest, rng));
+                    changed(i, j);
+                }
+            }
+            hole_from[i] = num_of_rows;
+        }
+    }
+    
+    // knock out each gem with a chance of 1 in 1000, like Scene::processQuake; return gems removed
+    int quake(GemRng& rng) {
+        int removed = 0;
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                if(at(i, j) != EMPTY && rng.below(1000) == 0) {
+                    set(i, j, EMPTY);
+                    removed++;
+                }
+            }
+        }
+        return removed;
+    }
+    
+    // clear, fall and refill until the board comes to rest
+    CascadeResult resolve(GemRng& rng) {
+        CascadeResult result;
+        while(clearMatches(result) > 0) {
+            collapse();
+            refill(rng);
+        }
+        return result;
+    }
+    
+    CascadeResult resolve(GemRng& rng, SpawnPolicy& policy) {
+        CascadeResult result;
+        while(clearMatches(result) > 0) {
+            collapse();
+            refill(rng, policy);
+        }
+        return result;
+    }
+    
+    // the n-th gem to spawn in column i under spawn_seed. part of the position, so moves on
+    // different columns commute: playing them in either order spawns the same gems
+    int streamGem(int i) {
+        unsigned int n = spawned[i];
+        zobrist ^= spawnKey(i, n) ^ spawnKey(i, n + 1);
+        spawned[i] = n + 1;
+        GemRng mix(spawn_seed ^ ((unsigned long long)i << 32) ^ n);
+        return mix.below(gem_types);
+    }
+    
+    // fill the holes at the top of every column from the per-column spawn streams
+    void refillFromStreams() {
+        for(int i = 0; i < num_of_cols; i++) {
+            int from = hole_from[i];
+            for(int j = from; j < num_of_rows; j++) {
+                if(at(i, j) == EMPTY) {
+                    put(i*num_of_rows + j, streamGem(i));
+                    changed(i, j);
+                }
+            }
+            hole_from[i] = num_of_rows;
+        }
+    }
+    
+    CascadeResult resolveFromStreams() {
+        CascadeResult result;
+        while(clearMatches(result) > 0) {
+            collapse();
+            refillFromStreams();
+        }
+        return result;
+    }
+    
+    // play m with deterministic refills: the outcome is a function of the position alone
+    CascadeResult playFromStreams(const Move& m) {
+        swap(m.i1, m.j1, m.i2, m.j2);
+        return resolveFromStreams();
+    }
+    
+    CascadeResult play(const Move& m, GemRng& rng) {
+        swap(m.i1, m.j1, m.i2, m.j2);
+        return resolve(rng);
+    }
+    
+    CascadeResult play(const Move& m, GemRng& rng, SpawnPolicy& policy) {
+        swap(m.i1, m.j1, m.i2, m.j2);
+        return resolve(rng, policy);
+    }
+};
+
+
+// every type equally likely, what Board::refill does without a policy
+class UniformSpawn : public SpawnPolicy {
+public:
+    int spawn(const Board& board, int /*i*/, int /*j*/, int /*from*/, GemRng& rng) {
+        return rng.below(board.gem_types);
+    }
+};
+
+// types drawn in proportion to weights[type]; types past the end of weights never spawn. negative
+// weights count as zero, and when no type in play has any weight left spawns fall back to uniform
+class WeightedSpawn : public SpawnPolicy {
+    std::vector<double> cumulative;
+public:
+    WeightedSpawn(const std::vector<double>& weights) {
+        double total = 0;
+        for(int t = 0; t < (int)weights.size(); t++) {
+            total += std::max(weights[t], 0.0);
+            cumulative.push_back(total);
+        }
+    }
+    
+    int spawn(const Board& board, int /*i*/, int /*j*/, int /*from*/, GemRng& rng) {
+        int n = std::min((int)cumulative.size(), board.gem_types);
+        if(n == 0 || !(cumulative[n - 1] > 0)) {
+            return rng.below(board.gem_types);
+        }
+        double x = (rng.next() >> 11) * (1.0 / 9007199254740992.0) * cumulative[n - 1];
+        int t = 0;
+        while(t < n - 1 && x >= cumulative[t]) t++;
+        return t;
+    }
+};
+
+// never spawns a gem that completes a run, so refills do not chain into free cascades
+class AntiCascadeSpawn : public SpawnPolicy {
+public:
+    int spawn(const Board& board, int i, int j, int /*from*/, GemRng& rng) {
+        // at most four types can complete a run at one cell, give up after a few draws
+        int t = rng.below(board.gem_types);
+        for(int tries = 0; tries < 8 && board.completesRun(i, j, t); tries++) {
+            t = rng.below(board.gem_types);
+        }
+        return t;
+    }
+};
+
+// the lowest new gem of each refilled column is picked, where it can be, among the types that form a
+// move shape there without completing a run. a refill always leaves a legal swap behind or starts a
+// cascade that refills again, so boards rarely drift into deadlock. costs one local shape test per
+// refilled column, the gems above the lowest spawn uniformly
+class AntiDeadlockSpawn : public SpawnPolicy {
+public:
+    int spawn(const Board& board, int i, int j, int from, GemRng& rng) {
+        if(j == from) {
+            int candidates[32];
+            int n = 0;
+            for(int t = 0; t < board.gem_types && n < 32; t++) {
+                if(!board.completesRun(i, j, t) && board.formsMove(i, j, t)) {
+                    candidates[n++] = t;
                 }
             }
+            if(n > 0) {
+                return candidates[rng.below(n)];
+            }
+        }
+        return rng.below(board.gem_types);
+    }
+};
+
+// designed levels: column i spawns columns[i] in order, then falls back to another policy, not owned,
+// or to uniform spawns without one. keeps a cursor per column, so one instance serves one board
+class ScriptedSpawn : public SpawnPolicy {
+    std::vector<std::vector<int> > columns;
+    std::vector<int> cursor;
+    UniformSpawn uniform;
+    SpawnPolicy* fallback;
+public:
+    ScriptedSpawn(const std::vector<std::vector<int> >& _columns, SpawnPolicy* _fallback = nullptr) {
+        columns = _columns;
+        cursor.assign(columns.size(), 0);
+        fallback = _fallback ? _fallback : &uniform;
+    }
+    
+    void rewind() {
+        cursor.assign(columns.size(), 0);
+    }
+    
+    int spawn(const Board& board, int i, int j, int from, GemRng& rng) {
+        if(i < (int)columns.size() && cursor[i] < (int)columns[i].size()) {
+            return columns[i][cursor[i]++];
+        }
+        return fallback->spawn(board, i, j, from, rng);
+    }
+};
+
+// the columns of a ScriptedSpawn from a text file: one line per column from the left, gem types in the
+// order they spawn, separated by blanks. false if the file can't be read or holds anything but types
+// below gem_types
+bool readSpawnScript(const char* path, int gem_types, std::vector<std::vector<int> >& columns) {
+    FILE* file = fopen(path, "r");
+    if(file == NULL) {
+        return false;
+    }
+    columns.assign(1, std::vector<int>());
+    bool valid = true;
+    int c = fgetc(file);
+    while(c != EOF && valid) {
+        if(c == '\n') {
+            columns.push_back(std::vector<int>());
+            c = fgetc(file);
+        }
+        else if(c == ' ' || c == '\t' || c == '\r') {
+            c = fgetc(file);
+        }
+        else if(c >= '0' && c <= '9') {
+            int gem_type = 0;
+            for(; c >= '0' && c <= '9' && gem_type < gem_types; c = fgetc(file)) gem_type = gem_type*10 + c - '0';
+            valid = gem_type < gem_types;
+            columns.back().push_back(gem_type);
+        }
+        else {
+            valid = false;
+        }
+    }
+    fclose(file);
+    return valid;
+}
+
+// by name, for the command line: uniform, anti-cascade, anti-deadlock, weighted:w0,w1,... with one
+// weight per gem type, or scripted:file with a file for readSpawnScript, falling back to uniform.
+// nullptr if the name is unknown or its weights or script don't parse
+SpawnPolicy* makeSpawnPolicy(const char* name, int gem_types) {
+    if(!strcmp(name, "uniform")) return new UniformSpawn();
+    if(!strcmp(name, "anti-cascade")) return new AntiCascadeSpawn();
+    if(!strcmp(name, "anti-deadlock")) return new AntiDeadlockSpawn();
+    if(!strncmp(name, "weighted:", 9)) {
+        std::vector<double> weights;
+        const char* next = name + 9;
+        while(true) {
+            char* end;
+            weights.push_back(strtod(next, &end));
+            if(end == next || (*end != ',' && *end != 0)) {
+                return nullptr;
+            }
+            if(*end == 0) {
+                return new WeightedSpawn(weights);
+            }
+            next = end + 1;
+        }
+    }
+    if(!strncmp(name, "scripted:", 9)) {
+        std::vector<std::vector<int> > columns;
+        return readSpawnScript(name + 9, gem_types, columns) ? new ScriptedSpawn(columns) : nullptr;
+    }
+    return nullptr;
+}
+
+
+// fixed set of threads that split index ranges between them and steal from each other when they run dry.
+// the calling thread works as worker 0, so a pool of one runs everything inline
+class WorkerPool {
+    // each worker's remaining range [begin, end) packed into one word so owner and thieves can CAS it.
+    // padded rather than aligned to a cache line: plain new ignores extended alignment before C++17,
+    // and with a 64 byte stride no two workers' words share a line wherever the array starts
+    struct Range {
+        std::atomic<unsigned long long> bounds;
+        char padding[64 - sizeof(std::atomic<unsigned long long>)];
+    };
+    
+    std::vector<std::thread> threads;
+    Range* ranges;
+    int num_of_workers;
+    
+    std::mutex mutex;
+    std::condition_variable wake;
+    unsigned long long generation;
+    bool stopping;
+    const std::function<void(int, int)>* job;
+    std::atomic<int> busy_workers;
+    
+    static unsigned long long pack(unsigned int begin, unsigned int end) {
+        return ((unsigned long long)begin << 32) | end;
+    }
+    
+    // take the next index from the front of our own range
+    bool takeOwn(int worker, int& index) {
+        std::atomic<unsigned long long>& bounds = ranges[worker].bounds;
+        unsigned long long current = bounds.load(std::memory_order_acquire);
+        while(true) {
+            unsigned int begin = (unsigned int)(current >> 32);
+            unsigned int end = (unsigned int)current;
+            if(begin >= end) {
+                return false;
+            }
+            if(bounds.compare_exchange_weak(current, pack(begin + 1, end), std::memory_order_acq_rel)) {
+                index = begin;
+                return true;
+            }
+        }
+    }
+    
+    // move the back half of some other worker's range into ours
+    bool steal(int worker) {
+        for(int k = 1; k < num_of_workers; k++) {
+            std::atomic<unsigned long long>& victim = ranges[(worker + k) % num_of_workers].bounds;
+            unsigned long long current = victim.load(std::memory_order_acquire);
+            while(true) {
+                unsigned int begin = (unsigned int)(current >> 32);
+                unsigned int end = (unsigned int)current;
+                if(begin >= end) {
+                    break;
+                }
+                unsigned int middle = end - (end - begin + 1)/2;
+                if(victim.compare_exchange_weak(current, pack(begin, middle), std::memory_order_acq_rel)) {
+                    ranges[worker].bounds.store(pack(middle, end), std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    void work(int worker) {
+        int index;
+        while(takeOwn(worker, index) || (steal(worker) && takeOwn(worker, index))) {
+            (*job)(index, worker);
+        }
+    }
+    
+    void threadMain(int worker) {
+        unsigned long long seen = 0;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while(!stopping && generation == seen) {
+                    wake.wait(lock);
+                }
+                if(stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            work(worker);
+            busy_workers.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+    
+public:
+    // 0 threads means one per hardware core
+    WorkerPool(int _num_of_workers = 0) {
+        num_of_workers = _num_of_workers;
+        if(num_of_workers <= 0) {
+            num_of_workers = std::thread::hardware_concurrency();
+        }
+        if(num_of_workers <= 0) {
+            num_of_workers = 1;
+        }
+        ranges = new Range[num_of_workers];
+        for(int w = 0; w < num_of_workers; w++) {
+            ranges[w].bounds.store(0);
+        }
+        generation = 0;
+        stopping = false;
+        job = nullptr;
+        busy_workers = 0;
+        for(int w = 1; w < num_of_workers; w++) {
+            threads.push_back(std::thread(&WorkerPool::threadMain, this, w));
+        }
+    }
+    
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(int i = 0; i < (int)threads.size(); i++) threads[i].join();
+        delete[] ranges;
+    }
+    
+    int size() const {
+        return num_of_workers;
+    }
+    
+    // run fn(index, worker) for every index in [0, n) and return once all of them are done
+    void parallelFor(int n, const std::function<void(int, int)>& fn) {
+        if(num_of_workers == 1 || n <= 1) {
+            for(int i = 0; i < n; i++) fn(i, 0);
+            return;
+        }
+        for(int w = 0; w < num_of_workers; w++) {
+            unsigned int begin = (unsigned int)((long long)n * w / num_of_workers);
+            unsigned int end = (unsigned int)((long long)n * (w + 1) / num_of_workers);
+            ranges[w].bounds.store(pack(begin, end), std::memory_order_relaxed);
+        }
+        job = &fn;
+        busy_workers.store(num_of_workers - 1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        while(busy_workers.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        job = nullptr;
+    }
+};
+
+
+// fixed-size hash table of search results shared by all workers without locks. each entry keeps
+// key^data next to data, so a torn write from two threads storing at once fails the check on probe
+// instead of returning another position's value
+class TranspositionTable {
+    struct Entry {
+        std::atomic<unsigned long long> check;
+        std::atomic<unsigned long long> data;
+    };
+    Entry* entries;
+    unsigned long long mask;
+    
+    static unsigned long long pack(int depth, int value) {
+        return (1ULL << 40) | ((unsigned long long)(depth & 0xFF) << 32) | (unsigned int)value;
+    }
+    
+public:
+    TranspositionTable(int log2_entries = 18) {
+        mask = (1ULL << log2_entries) - 1;
+        entries = new Entry[mask + 1];
+        clear();
+    }
+    
+    ~TranspositionTable() {
+        delete[] entries;
+    }
+    
+    void clear() {
+        for(unsigned long long k = 0; k <= mask; k++) {
+            entries[k].check.store(0, std::memory_order_relaxed);
+            entries[k].data.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    // value searched to exactly this depth from the position with this key, if we have it
+    bool probe(unsigned long long key, int depth, int& value) {
+        Entry& entry = entries[key & mask];
+        unsigned long long data = entry.data.load(std::memory_order_relaxed);
+        unsigned long long check = entry.check.load(std::memory_order_relaxed);
+        if((check ^ data) != key || data == 0 || (int)((data >> 32) & 0xFF) != depth) {
+            return false;
+        }
+        value = (int)(unsigned int)data;
+        return true;
+    }
+    
+    // always replaces, positions in a search are looked up soon after they are stored
+    void store(unsigned long long key, int depth, int value) {
+        Entry& entry = entries[key & mask];
+        unsigned long long data = pack(depth, value);
+        entry.check.store(key ^ data, std::memory_order_relaxed);
+        entry.data.store(data, std::memory_order_relaxed);
+    }
+};
+
+
+struct MoveScore {
+    Move move;
+    CascadeResult result;
+    int score;
+    
+    MoveScore() {
+        score = -1;
+    }
+};
+
+// one-ply solver: plays every legal swap on a copy of the board and keeps the one with the best cascade.
+// refills come from a fixed seed, so the same board always gets the same answer
+class Solver {
+    WorkerPool* pool;
+    std::vector<Board> scratch;     // one board per worker, reused between calls
+    std::vector<MoveScore> scores;
+    std::vector<Move> moves;
+    
+    // per-worker boards and move lists for each remaining search depth
+    struct SearchStack {
+        std::vector<Board> boards;
+        std::vector<std::vector<Move> > moves;
+        long long nodes;
+        long long probes;
+        long long hits;
+    };
+    std::vector<SearchStack> stacks;
+    
+    // best total score reachable from a board at rest within depth more moves
+    int searchValue(const Board& board, int depth, SearchStack& stack) {
+        if(depth <= 0) {
+            return 0;
+        }
+        int value;
+        stack.probes++;
+        if(table.probe(board.hash(), depth, value)) {
+            stack.hits++;
+            return value;
+        }
+        std::vector<Move>& moves = stack.moves[depth];
+        Board& child = stack.boards[depth];
+        child = board;
+        child.markClean();
+        child.legalMoves(moves);
+        int best = 0;
+        for(int k = 0; k < (int)moves.size(); k++) {
+            int gained = child.playFromStreams(moves[k]).score();
+            stack.nodes++;
+            int total = gained + searchValue(child, depth - 1, stack);
+            if(total > best) {
+                best = total;
+            }
+            child.restore(board);
+        }
+        table.store(board.hash(), depth, best);
+        return best;
+    }
+    
+public:
+    TranspositionTable table;
+    // filled in by Search: positions played out, table lookups, and lookups that answered a position
+    long long search_nodes;
+    long long search_probes;
+    long long search_hits;
+
+    unsigned long long refill_seed;
+    // boards with fewer cells than this are solved on the calling thread, waking workers costs more
+    int parallel_cells;
+    
+    Solver(WorkerPool* _pool) {
+        pool = _pool;
+        scratch.resize(pool->size());
+        stacks.resize(pool->size());
+        refill_seed = 1;
+        parallel_cells = 32*32;
+        search_nodes = 0;
+        search_probes = 0;
+        search_hits = 0;
+    }
+    
+    // copy must hold board at rest; it is put back the way it was afterwards
+    MoveScore evaluate(const Board& board, const Move& move, Board& copy) {
+        GemRng rng(refill_seed);
+        MoveScore s;
+        s.move = move;
+        s.result = copy.play(move, rng);
+        s.score = s.result.score();
+        copy.restore(board);
+        return s;
+    }
+    
+    // best legal swap of a board at rest, or a MoveScore with score -1 if the board has none
+    MoveScore BestMove(const Board& board) {
+        scratch[0] = board;
+        scratch[0].markClean();
+        scratch[0].legalMoves(moves);
+        scores.resize(moves.size());
+        
+        if(board.num_of_cols*board.num_of_rows < parallel_cells) {
+            for(int k = 0; k < (int)moves.size(); k++) {
+                scores[k] = evaluate(board, moves[k], scratch[0]);
+            }
+        }
+        else {
+            for(int w = 1; w < (int)scratch.size(); w++) {
+                scratch[w] = scratch[0];
+            }
+            pool->parallelFor(moves.size(), [&](int k, int worker) {
+                scores[k] = evaluate(board, moves[k], scratch[worker]);
+            });
+        }
+        
+        MoveScore best;
+        for(int k = 0; k < (int)scores.size(); k++) {
+            if(scores[k].score > best.score) {
+                best = scores[k];
+            }
+        }
+        return best;
+    }
+    
+    // depth-ply lookahead. refills come from the board's per-column spawn streams, so a position's value
+    // does not depend on the path to it and transpositions are evaluated once through the shared table.
+    // score holds the best total over all plies, result the cascade of the first move. a depth below 1
+    // searches one ply
+    MoveScore Search(const Board& board, int depth) {
+        depth = std::max(depth, 1);
+        Board root = board;
+        root.markClean();
+        root.legalMoves(moves);
+        scores.resize(moves.size());
+        for(int w = 0; w < (int)stacks.size(); w++) {
+            stacks[w].boards.resize(depth + 1);
+            stacks[w].moves.resize(depth + 1);
+            stacks[w].nodes = 0;
+            stacks[w].probes = 0;
+            stacks[w].hits = 0;
+            scratch[w] = root;
+        }
+        
+        pool->parallelFor(moves.size(), [&](int k, int worker) {
+            Board& child = scratch[worker];
+            MoveScore s;
+            s.move = moves[k];
+            s.result = child.playFromStreams(moves[k]);
+            stacks[worker].nodes++;
+            s.score = s.result.score() + searchValue(child, depth - 1, stacks[worker]);
+            child.restore(root);
+            scores[k] = s;
+        });
+        
+        search_nodes = 0;
+        search_probes = 0;
+        search_hits = 0;
+        for(int w = 0; w < (int)stacks.size(); w++) {
+            search_nodes += stacks[w].nodes;
+            search_probes += stacks[w].probes;
+            search_hits += stacks[w].hits;
+        }
+        MoveScore best;
+        for(int k = 0; k < (int)scores.size(); k++) {
+            if(scores[k].score > best.score) {
+                best = scores[k];
+            }
+        }
+        return best;
+    }
+};
+
+
+// per-worker scratch for RolloutBot so rollouts never allocate once warmed up
+struct RolloutArena {
+    Board board;
+    std::vector<Move> moves;
+    std::vector<long long> total;   // summed rollout score per root move
+};
+
+// what the rollout bot thinks of one root move
+struct RolloutScore {
+    Move move;
+    double mean_score;
+    int rollouts;
+    
+    RolloutScore() {
+        mean_score = -1;
+        rollouts = 0;
+    }
+};
+
+// Monte Carlo lookahead: every root move is followed by random plies with random refills, and the move
+// with the best average total wins. each rollout draws its refills from its own stream derived from
+// seed and its index, so results do not depend on how rollouts are spread over threads
+class RolloutBot {
+    WorkerPool* pool;
+    std::vector<RolloutArena> arenas;
+    Board root;
+    std::vector<Move> root_moves;
+    
+    static unsigned long long streamSeed(unsigned long long seed, int rollout) {
+        GemRng mix(seed ^ ((unsigned long long)rollout * 0xD1B54A32D192ED03ULL));
+        return mix.next();
+    }
+    
+    // one rollout from root, leaves the arena board back at root
+    long long rollout(const Move& first, int index, RolloutArena& arena) {
+        GemRng rng(streamSeed(seed, index));
+        long long total = arena.board.play(first, rng).score();
+        for(int ply = 1; ply < depth; ply++) {
+            arena.board.legalMoves(arena.moves);
+            if(arena.moves.empty()) {
+                total -= deadlock_penalty;
+                break;
+            }
+            const Move& m = arena.moves[rng.below(arena.moves.size())];
+            total += arena.board.play(m, rng).score();
+        }
+        arena.board.restore(root);
+        return total;
+    }
+    
+public:
+    unsigned long long seed;
+    int depth;                  // plies per rollout, including the root move
+    int rollouts_per_move;
+    int deadlock_penalty;       // subtracted when a rollout runs out of moves
+    
+    RolloutBot(WorkerPool* _pool, unsigned long long _seed = 1) {
+        pool = _pool;
+        arenas.resize(pool->size());
+        seed = _seed;
+        depth = 3;
+        rollouts_per_move = 64;
+        deadlock_penalty = 50;
+    }
+    
+    // best move of a board at rest by mean rollout score, mean_score -1 if there is no legal move
+    RolloutScore BestMove(const Board& board) {
+        root = board;
+        root.markClean();
+        root.legalMoves(root_moves);
+        int num_of_moves = root_moves.size();
+        for(int w = 0; w < (int)arenas.size(); w++) {
+            arenas[w].board = root;
+            arenas[w].total.assign(num_of_moves, 0);
+        }
+        
+        int num_of_rollouts = num_of_moves * rollouts_per_move;
+        pool->parallelFor(num_of_rollouts, [&](int index, int worker) {
+            int k = index % num_of_moves;
+            arenas[worker].total[k] += rollout(root_moves[k], index, arenas[worker]);
+        });
+        
+        RolloutScore best;
+        for(int k = 0; k < num_of_moves; k++) {
+            long long total = 0;
+            for(int w = 0; w < (int)arenas.size(); w++) {
+                total += arenas[w].total[k];
+            }
+            double mean_score = (double)total / rollouts_per_move;
+            if(best.rollouts == 0 || mean_score > best.mean_score) {
+                best.move = root_moves[k];
+                best.mean_score = mean_score;
+                best.rollouts = rollouts_per_move;
+            }
+        }
+        return best;
+    }
+};
+
+
+// many independent boards stepped together. boards are grouped by lanes, and within a group the same cell
+// of every board is stored side by side, so each rules step is a fixed-length loop over lanes with no
+// branches that the compiler turns into SIMD: one instruction stream advances a whole group at once
+class BoardBatch {
+public:
+    static const int lanes = 32;
+    enum { EMPTY = 0xFF, OUTSIDE = 0xFE };
+    
+private:
+    unsigned char outside[lanes];
+    std::vector<unsigned char> cells;       // [group][cell][lane], cell = i*num_of_rows + j like Board
+    std::vector<unsigned char> marked;      // [cell][lane] scratch for one group
+    std::vector<unsigned int> rng;          // [group][lane] xorshift32 state per board
+    int num_of_cells;
+    
+    unsigned char* group(int g) {
+        return &cells[(size_t)g*num_of_cells*lanes];
+    }
+    
+    // the lane loops below work on local arrays: the compiler cannot prove that pointers into cells,
+    // marked and the caller's buffers don't overlap, and would otherwise refuse to vectorize them
+    
+    // mark every gem in a run of three or more; returns, per lane, whether anything was marked
+    void findMatches(int g, unsigned char* any) {
+        unsigned char* c = group(g);
+        unsigned char found[lanes];
+        for(int l = 0; l < lanes; l++) found[l] = 0;
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                const unsigned char* self = c + (i*num_of_rows + j)*lanes;
+                // neighbours off the board read a row of OUTSIDE, which matches no gem
+                const unsigned char* l1 = i >= 1 ? self - num_of_rows*lanes : outside;
+                const unsigned char* l2 = i >= 2 ? self - 2*num_of_rows*lanes : outside;
+                const unsigned char* r1 = i + 1 < num_of_cols ? self + num_of_rows*lanes : outside;
+                const unsigned char* r2 = i + 2 < num_of_cols ? self + 2*num_of_rows*lanes : outside;
+                const unsigned char* d1 = j >= 1 ? self - lanes : outside;
+                const unsigned char* d2 = j >= 2 ? self - 2*lanes : outside;
+                const unsigned char* u1 = j + 1 < num_of_rows ? self + lanes : outside;
+                const unsigned char* u2 = j + 2 < num_of_rows ? self + 2*lanes : outside;
+                unsigned char mark[lanes];
+                for(int l = 0; l < lanes; l++) {
+                    unsigned char v = self[l];
+                    unsigned char el1 = l1[l] == v;
+                    unsigned char el2 = l2[l] == v;
+                    unsigned char er1 = r1[l] == v;
+                    unsigned char er2 = r2[l] == v;
+                    unsigned char ed1 = d1[l] == v;
+                    unsigned char ed2 = d2[l] == v;
+                    unsigned char eu1 = u1[l] == v;
+                    unsigned char eu2 = u2[l] == v;
+                    unsigned char m = ((el1 & el2) | (el1 & er1) | (er1 & er2) | (ed1 & ed2) | (ed1 & eu1) | (eu1 & eu2)) & (v != EMPTY);
+                    mark[l] = m;
+                    found[l] |= m;
+                }
+                memcpy(&marked[(i*num_of_rows + j)*lanes], mark, lanes);
+            }
+        }
+        memcpy(any, found, lanes);
+    }
+    
+    // empty the marked cells, counting them per lane
+    void clearMarked(int g, int* cleared) {
+        unsigned char* c = group(g);
+        int count[lanes];
+        for(int l = 0; l < lanes; l++) count[l] = 0;
+        for(int k = 0; k < num_of_cells; k++) {
+            unsigned char cell[lanes];
+            unsigned char mark[lanes];
+            memcpy(cell, c + k*lanes, lanes);
+            memcpy(mark, &marked[k*lanes], lanes);
+            for(int l = 0; l < lanes; l++) {
+                count[l] += mark[l];
+                cell[l] = mark[l] ? (unsigned char)EMPTY : cell[l];
+            }
+            memcpy(c + k*lanes, cell, lanes);
+        }
+        for(int l = 0; l < lanes; l++) cleared[l] += count[l];
+    }
+    
+    // let gems fall towards row 0, one row per pass until nothing moves in any lane
+    void collapse(int g) {
+        unsigned char* c = group(g);
+        for(int i = 0; i < num_of_cols; i++) {
+            unsigned char* column = c + i*num_of_rows*lanes;
+            bool moved = true;
+            for(int pass = 0; moved && pass < num_of_rows - 1; pass++) {
+                unsigned char any = 0;
+                unsigned char lower[lanes];
+                unsigned char upper[lanes];
+                memcpy(lower, column, lanes);
+                for(int j = 0; j + 1 < num_of_rows; j++) {
+                    memcpy(upper, column + (j + 1)*lanes, lanes);
+                    for(int l = 0; l < lanes; l++) {
+                        unsigned char move = (lower[l] == EMPTY) & (upper[l] != EMPTY);
+                        unsigned char fallen = move ? upper[l] : lower[l];
+                        upper[l] = move ? (unsigned char)EMPTY : upper[l];
+                        lower[l] = fallen;
+                        any |= move;
+                    }
+                    memcpy(column + j*lanes, lower, lanes);
+                    memcpy(lower, upper, lanes);
+                }
+                memcpy(column + (num_of_rows - 1)*lanes, lower, lanes);
+                moved = any != 0;
+            }
+        }
+    }
+    
+    // draw a gem for every lane and keep it where the cell is empty
+    void refill(int g) {
+        unsigned char* c = group(g);
+        unsigned int state[lanes];
+        memcpy(state, &rng[g*lanes], sizeof(state));
+        for(int k = 0; k < num_of_cells; k++) {
+            unsigned char cell[lanes];
+            memcpy(cell, c + k*lanes, lanes);
+            for(int l = 0; l < lanes; l++) {
+                unsigned int x = state[l];
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                state[l] = x;
+                unsigned char gem_type = (unsigned char)(((x >> 16) * (unsigned int)gem_types) >> 16);
+                cell[l] = cell[l] == EMPTY ? gem_type : cell[l];
+            }
+            memcpy(c + k*lanes, cell, lanes);
+        }
+        memcpy(&rng[g*lanes], state, sizeof(state));
+    }
+    
+    // per lane, whether x put at (i, j) would be in a run with two of the cells around it. skip is the
+    // neighbour x was swapped in from, which no longer holds x
+    void completesRun(const unsigned char* c, const unsigned char* x, int i, int j, int skip_i, int skip_j,
+                      unsigned char* found) {
+        const unsigned char* near[4][2];
+        const int di[4] = {-1, 1, 0, 0}, dj[4] = {0, 0, -1, 1};
+        for(int d = 0; d < 4; d++) {
+            for(int step = 0; step < 2; step++) {
+                int a = i + di[d]*(step + 1), b = j + dj[d]*(step + 1);
+                bool inside = a >= 0 && a < num_of_cols && b >= 0 && b < num_of_rows && !(a == skip_i && b == skip_j);
+                // a cell past the swapped one is not next to x either
+                if(step == 1 && near[d][0] == outside) inside = false;
+                near[d][step] = inside ? c + (a*num_of_rows + b)*lanes : outside;
+            }
+        }
+        unsigned char v[lanes], around[4][2][lanes], hit[lanes];
+        memcpy(v, x, lanes);
+        for(int d = 0; d < 4; d++) {
+            memcpy(around[d][0], near[d][0], lanes);
+            memcpy(around[d][1], near[d][1], lanes);
+        }
+        memcpy(hit, found, lanes);
+        for(int l = 0; l < lanes; l++) {
+            unsigned char l1 = around[0][0][l] == v[l], l2 = around[0][1][l] == v[l];
+            unsigned char r1 = around[1][0][l] == v[l], r2 = around[1][1][l] == v[l];
+            unsigned char d1 = around[2][0][l] == v[l], d2 = around[2][1][l] == v[l];
+            unsigned char u1 = around[3][0][l] == v[l], u2 = around[3][1][l] == v[l];
+            hit[l] |= (l1 & l2) | (l1 & r1) | (r1 & r2) | (d1 & d2) | (d1 & u1) | (u1 & u2);
+        }
+        memcpy(found, hit, lanes);
+    }
+    
+    // clear, fall and refill until no lane of the group has a run left
+    void resolve(int g, int* cleared, unsigned char* any) {
+        while(true) {
+            findMatches(g, any);
+            unsigned char active = 0;
+            for(int l = 0; l < lanes; l++) active |= any[l];
+            if(!active) {
+                return;
+            }
+            clearMarked(g, cleared);
+            collapse(g);
+            refill(g);
+        }
+    }
+    
+public:
+    int num_of_boards;      // rounded up to a whole number of groups
+    int num_of_groups;
+    int num_of_cols;
+    int num_of_rows;
+    int gem_types;
+    
+    BoardBatch(int _num_of_boards, int _num_of_cols, int _num_of_rows, int _gem_types) {
+        num_of_groups = (_num_of_boards + lanes - 1) / lanes;
+        num_of_boards = num_of_groups * lanes;
+        num_of_cols = _num_of_cols;
+        num_of_rows = _num_of_rows;
+        gem_types = _gem_types;
+        num_of_cells = num_of_cols * num_of_rows;
+        cells.assign((size_t)num_of_groups*num_of_cells*lanes, (unsigned char)EMPTY);
+        marked.assign(num_of_cells*lanes, 0);
+        rng.assign(num_of_groups*lanes, 1);
+        for(int l = 0; l < lanes; l++) outside[l] = OUTSIDE;
+    }
+    
+    int at(int board, int i, int j) const {
+        int g = board / lanes;
+        int l = board % lanes;
+        int value = cells[((size_t)g*num_of_cells + i*num_of_rows + j)*lanes + l];
+        return value == EMPTY ? Board::EMPTY : value;
+    }
+    
+    // fresh random boards at rest, every board with its own stream derived from seed
+    void reset(unsigned long long seed) {
+        GemRng seeds(seed);
+        for(int k = 0; k < (int)rng.size(); k++) {
+            // xorshift32 must never hold zero
+            rng[k] = (unsigned int)seeds.next() | 1;
+        }
+        for(int k = 0; k < (int)cells.size(); k++) {
+            cells[k] = EMPTY;
+        }
+        int cleared[lanes];
+        unsigned char any[lanes];
+        for(int g = 0; g < num_of_groups; g++) {
+            refill(g);
+            resolve(g, cleared, any);
+        }
+    }
+    
+    // start the boards with which[board] set over with fresh random gems, leaving the others alone
+    void resetBoards(const unsigned char* which) {
+        int cleared[lanes];
+        unsigned char any[lanes];
+        for(int g = 0; g < num_of_groups; g++) {
+            bool any_reset = false;
+            unsigned char* c = group(g);
+            for(int l = 0; l < lanes; l++) {
+                if(which[g*lanes + l]) {
+                    any_reset = true;
+                    for(int k = 0; k < num_of_cells; k++) c[k*lanes + l] = EMPTY;
+                }
+            }
+            // boards at rest have no holes and no runs, refilling and resolving leaves them as they are
+            if(any_reset) {
+                refill(g);
+                resolve(g, cleared, any);
+            }
+        }
+    }
+    
+    // the refill stream of a board, for replaying its spawns elsewhere
+    unsigned int stream(int board) const {
+        return rng[board];
+    }
+    
+    // legal[board]: whether some adjacent swap of the board makes a run. boards must be at rest. every
+    // swap is tested in all lanes at once, each of the two swapped gems against the cells around the
+    // cell it moves to
+    void hasLegalMove(unsigned char* legal) {
+        for(int g = 0; g < num_of_groups; g++) {
+            const unsigned char* c = group(g);
+            unsigned char found[lanes];
+            for(int l = 0; l < lanes; l++) found[l] = 0;
+            for(int i = 0; i < num_of_cols; i++) {
+                for(int j = 0; j < num_of_rows; j++) {
+                    const unsigned char* self = c + (i*num_of_rows + j)*lanes;
+                    if(i + 1 < num_of_cols) {
+                        const unsigned char* right = self + num_of_rows*lanes;
+                        completesRun(c, right, i, j, i + 1, j, found);
+                        completesRun(c, self, i + 1, j, i, j, found);
+                    }
+                    if(j + 1 < num_of_rows) {
+                        const unsigned char* up = self + lanes;
+                        completesRun(c, up, i, j, i, j + 1, found);
+                        completesRun(c, self, i, j + 1, i, j, found);
+                    }
+                }
+            }
+            memcpy(legal + g*lanes, found, lanes);
+        }
+    }
+    
+    // apply one swap per board (moves[board]) and resolve every cascade. cleared[board] gets the gems it
+    // removed, 0 for a swap that made no run, which is undone like an illegal move in the game
+    void step(const Move* moves, int* cleared) {
+        unsigned char any[lanes];
+        for(int g = 0; g < num_of_groups; g++) {
+            unsigned char* c = group(g);
+            int* group_cleared = cleared + g*lanes;
+            // the cells to swap differ per board, this part is a gather and stays scalar
+            for(int l = 0; l < lanes; l++) {
+                const Move& m = moves[g*lanes + l];
+                unsigned char& a = c[(m.i1*num_of_rows + m.j1)*lanes + l];
+                unsigned char& b = c[(m.i2*num_of_rows + m.j2)*lanes + l];
+                unsigned char temp = a;
+                a = b;
+                b = temp;
+                group_cleared[l] = 0;
+            }
+            findMatches(g, any);
+            for(int l = 0; l < lanes; l++) {
+                if(!any[l]) {
+                    const Move& m = moves[g*lanes + l];
+                    unsigned char& a = c[(m.i1*num_of_rows + m.j1)*lanes + l];
+                    unsigned char& b = c[(m.i2*num_of_rows + m.j2)*lanes + l];
+                    unsigned char temp = a;
+                    a = b;
+                    b = temp;
+                }
+            }
+            resolve(g, group_cleared, any);
+        }
+    }
+};
+
+
+// batched training environment on top of BoardBatch, in the style of a vectorised gym env.
+// actions index the adjacent swaps: a < (cols-1)*rows swaps (a / rows, a % rows) with its right
+// neighbour, the rest swap (b / (rows-1), b % (rows-1)) with its upper neighbour, b = a - (cols-1)*rows.
+// observations are one-hot planes, laid out [env][gem type][row][column], written straight into the
+// caller's buffer. finished environments restart by themselves on the step that reports them done.
+// nothing is allocated after construction
+class GemEnv {
+    BoardBatch batch;
+    std::vector<Move> moves;
+    std::vector<int> cleared;
+    std::vector<unsigned char> legal;   // per board, whether it still has a legal swap
+    std::vector<int> steps_taken;
+    std::vector<unsigned char> restart;
+    
+    Move decode(int action) const {
+        int horizontal = (num_of_cols - 1) * num_of_rows;
+        if(action < horizontal) {
+            int i = action / num_of_rows;
+            int j = action % num_of_rows;
+            return Move(i, j, i + 1, j);
+        }
+        action -= horizontal;
+        int i = action / (num_of_rows - 1);
+        int j = action % (num_of_rows - 1);
+        return Move(i, j, i, j + 1);
+    }
+    
+    void observe(int env, unsigned char* observations) {
+        int plane = num_of_cols * num_of_rows;
+        unsigned char* out = observations + (size_t)env * gem_types * plane;
+        memset(out, 0, gem_types * plane);
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                out[batch.at(env, i, j)*plane + j*num_of_cols + i] = 1;
+            }
+        }
+    }
+    
+public:
+    int num_of_envs;
+    int num_of_cols;
+    int num_of_rows;
+    int gem_types;
+    int max_steps;              // episode length limit
+    float illegal_reward;       // reward for a swap that makes no run
+    
+    GemEnv(int _num_of_envs, int _num_of_cols, int _num_of_rows, int _gem_types, int _max_steps = 200)
+        : batch(_num_of_envs, _num_of_cols, _num_of_rows, _gem_types) {
+        num_of_envs = _num_of_envs;
+        num_of_cols = _num_of_cols;
+        num_of_rows = _num_of_rows;
+        gem_types = _gem_types;
+        max_steps = _max_steps;
+        illegal_reward = 0;
+        // the batch pads to whole lane groups, padding boards just swap (0, 0) with (1, 0)
+        moves.assign(batch.num_of_boards, Move(0, 0, 1, 0));
+        cleared.assign(batch.num_of_boards, 0);
+        legal.assign(batch.num_of_boards, 0);
+        steps_taken.assign(num_of_envs, 0);
+        restart.assign(batch.num_of_boards, 0);
+    }
+    
+    int numActions() const {
+        return (num_of_cols - 1)*num_of_rows + num_of_cols*(num_of_rows - 1);
+    }
+    
+    // bytes of observation per environment
+    int observationSize() const {
+        return gem_types * num_of_cols * num_of_rows;
+    }
+    
+    void reset(unsigned long long seed, unsigned char* observations) {
+        batch.reset(seed);
+        for(int env = 0; env < num_of_envs; env++) {
+            steps_taken[env] = 0;
+            observe(env, observations);
+        }
+    }
+    
+    // actions[num_of_envs] in, rewards, dones and observations out
+    void step(const int* actions, float* rewards, unsigned char* dones, unsigned char* observations) {
+        for(int env = 0; env < num_of_envs; env++) {
+            moves[env] = decode(actions[env]);
+        }
+        batch.step(&moves[0], &cleared[0]);
+        batch.hasLegalMove(&legal[0]);
+        
+        bool any_restart = false;
+        for(int env = 0; env < num_of_envs; env++) {
+            rewards[env] = cleared[env] > 0 ? (float)cleared[env] : illegal_reward;
+            steps_taken[env]++;
+            bool done = steps_taken[env] >= max_steps || !legal[env];
+            dones[env] = done;
+            restart[env] = done;
+            if(done) {
+                steps_taken[env] = 0;
+                any_restart = true;
+            }
+        }
+        if(any_restart) {
+            batch.resetBoards(&restart[0]);
+        }
+        for(int env = 0; env < num_of_envs; env++) {
+            observe(env, observations);
+        }
+    }
+};
+
+
+// what one perft walk found: positions per ply (nodes[0] unused), gems cleared on the way, and an xor of
+// the hashes of every position reached
+struct PerftCount {
+    long long nodes[16];
+    long long cleared;
+    unsigned long long digest;
+    
+    PerftCount() {
+        for(int d = 0; d < 16; d++) nodes[d] = 0;
+        cleared = 0;
+        digest = 0;
+    }
+};
+
+// counts the positions reachable from a board in up to depth legal swaps, every swap played out with its
+// cascade and refills drawn from the per-column spawn streams, so the counts depend only on the board.
+// nodes and the digest are the regression oracle for changes to the rules engine, the timing its benchmark
+class Perft {
+    // per-worker root and boards and move lists, one per ply
+    struct Stack {
+        Board root;
+        std::vector<Board> boards;
+        std::vector<std::vector<Move> > moves;
+    };
+    WorkerPool* pool;
+    std::vector<Stack> stacks;
+    
+    void walk(const Board& board, int ply, Stack& stack, PerftCount& count) {
+        Board& child = stack.boards[ply];
+        std::vector<Move>& moves = stack.moves[ply];
+        child = board;
+        child.markClean();
+        child.legalMoves(moves);
+        for(int k = 0; k < (int)moves.size(); k++) {
+            CascadeResult result = child.playFromStreams(moves[k]);
+            count.nodes[ply + 1]++;
+            count.cleared += result.cleared;
+            count.digest ^= child.hash() * (2*ply + 3);
+            if(ply + 1 < depth) {
+                walk(child, ply + 1, stack, count);
+            }
+            child.restore(board);
+        }
+    }
+    
+public:
+    int depth;
+    
+    Perft(WorkerPool* _pool, int _depth) {
+        pool = _pool;
+        depth = _depth;
+        stacks.resize(pool->size());
+        for(int w = 0; w < (int)stacks.size(); w++) {
+            stacks[w].boards.resize(depth);
+            stacks[w].moves.resize(depth);
+        }
+    }
+    
+    // counts[b] for each of the boards, given as snapshots of snapshot_size bytes one after another and
+    // walked in parallel, each unpacked into the stack of the worker walking it. false if one of them
+    // could not be read
+    bool run(const std::vector<unsigned char>& roots, size_t snapshot_size, std::vector<PerftCount>& counts) {
+        int boards = roots.size() / snapshot_size;
+        std::vector<unsigned char> loaded(boards, 0);
+        counts.assign(boards, PerftCount());
+        pool->parallelFor(boards, [&](int b, int worker) {
+            Stack& stack = stacks[worker];
+            loaded[b] = stack.root.load(&roots[b*snapshot_size], snapshot_size);
+            if(loaded[b]) {
+                walk(stack.root, 0, stack, counts[b]);
+            }
+        });
+        return std::find(loaded.begin(), loaded.end(), 0) == loaded.end();
+    }
+};
+
+
+// headless self-play for balancing and as an engine benchmark, see simulateMain
+enum Policy {POLICY_RANDOM, POLICY_GREEDY, POLICY_SOLVER, POLICY_ROLLOUT};
+
+struct GameResult {
+    long long score;
+    int moves;
+    int chain_total;    // summed cascade depth over all moves
+    bool deadlocked;    // ran out of legal moves before max_moves
+};
+
+// plays whole games on a board of the rules engine, one game per worker at a time. each player has
+// a single-worker pool of its own, so the solver policy runs serially inside the parallel game loop
+class GameSimulator {
+    struct Player {
+        WorkerPool serial;
+        Solver solver;
+        RolloutBot bot;
+        std::vector<Move> moves;
+        long long rollouts;
+        long long nodes, probes, hits;  // summed over the solver policy's searches
+        SpawnPolicy* spawn_policy;      // owned, rewound for every game; nullptr spawns uniformly
+        
+        Player() : serial(1), solver(&serial), bot(&serial), rollouts(0), nodes(0), probes(0), hits(0),
+                   spawn_policy(nullptr) {}
+        
+        ~Player() {
+            delete spawn_policy;
+        }
+    };
+    WorkerPool* pool;
+    std::vector<Player*> players;
+    
+    Move choose(Board& board, Player& player, GemRng& rng) {
+        if(policy == POLICY_RANDOM) {
+            return player.moves[rng.below(player.moves.size())];
+        }
+        if(policy == POLICY_GREEDY) {
+            return player.solver.BestMove(board).move;
+        }
+        if(policy == POLICY_ROLLOUT) {
+            // rollouts are seeded from the game, so a game plays the same on any core count
+            player.bot.seed = rng.next();
+            player.bot.depth = search_depth;
+            player.rollouts += (long long)player.moves.size() * player.bot.rollouts_per_move;
+            return player.bot.BestMove(board).move;
+        }
+        Move m = player.solver.Search(board, search_depth).move;
+        player.nodes += player.solver.search_nodes;
+        player.probes += player.solver.search_probes;
+        player.hits += player.solver.search_hits;
+        return m;
+    }
+    
+public:
+    int num_of_cols;
+    int num_of_rows;
+    int gem_types;
+    int max_moves;
+    int search_depth;           // plies the solver looks ahead and each rollout plays, root move included
+    Policy policy;
+    
+    GameSimulator(WorkerPool* _pool, int _num_of_cols = 10, int _num_of_rows = 10, int _gem_types = 8) {
+        pool = _pool;
+        num_of_cols = _num_of_cols;
+        num_of_rows = _num_of_rows;
+        gem_types = _gem_types;
+        max_moves = 100;
+        search_depth = 2;
+        policy = POLICY_GREEDY;
+        for(int w = 0; w < pool->size(); w++) {
+            players.push_back(new Player());
+        }
+    }
+    
+    ~GameSimulator() {
+        for(int w = 0; w < (int)players.size(); w++) {
+            delete players[w];
+        }
+    }
+    
+    // refills by the makeSpawnPolicy of that name, one instance per worker since policies may keep
+    // per-game state; false if the name is unknown
+    bool setSpawnPolicy(const char* name) {
+        for(int w = 0; w < (int)players.size(); w++) {
+            delete players[w]->spawn_policy;
+            players[w]->spawn_policy = makeSpawnPolicy(name, gem_types);
+            if(!players[w]->spawn_policy) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    GameResult play(unsigned long long seed, Player& player) {
+        GemRng rng(seed);
+        Board board(num_of_cols, num_of_rows, gem_types);
+        board.spawn_seed = seed;
+        player.solver.refill_seed = seed;
+        SpawnPolicy* spawn_policy = player.spawn_policy;
+        if(spawn_policy) spawn_policy->rewind();
+        // the opening cascade is the board's, not the player's
+        board.refill(rng);
+        board.resolve(rng);
+        
+        GameResult result;
+        result.score = 0;
+        result.moves = 0;
+        result.chain_total = 0;
+        result.deadlocked = false;
+        while(result.moves < max_moves) {
+            board.markClean();
+            board.legalMoves(player.moves);
+            if(player.moves.empty()) {
+                result.deadlocked = true;
+                break;
+            }
+            Move m = choose(board, player, rng);
+            board.markClean();
+            CascadeResult cascade = spawn_policy ? board.play(m, rng, *spawn_policy) : board.play(m, rng);
+            result.score += cascade.score();
+            result.chain_total += cascade.chain;
+            result.moves++;
+        }
+        return result;
+    }
+    
+    // rollouts the rollout policy has played over all games so far
+    long long rollouts() const {
+        long long total = 0;
+        for(int w = 0; w < (int)players.size(); w++) {
+            total += players[w]->rollouts;
+        }
+        return total;
+    }
+    
+    // the solver policy's positions played, transposition table lookups and hits over all games so far
+    void searchCounts(long long& nodes, long long& probes, long long& hits) const {
+        nodes = probes = hits = 0;
+        for(int w = 0; w < (int)players.size(); w++) {
+            nodes += players[w]->nodes;
+            probes += players[w]->probes;
+            hits += players[w]->hits;
+        }
+    }
+    
+    // results[game] for games seeded from seed; the same seed gives the same results on any core count
+    void run(int games, unsigned long long seed, std::vector<GameResult>& results) {
+        results.resize(games);
+        pool->parallelFor(games, [&](int game, int worker) {
+            GemRng mix(seed ^ ((unsigned long long)game * 0xD1B54A32D192ED03ULL));
+            results[game] = play(mix.next(), *players[worker]);
+        });
+    }
+};
+
+
+// what the board is busy with; each phase only runs its own work in Scene::Step
+enum GamePhase {
+    PHASE_IDLE,         // waiting for input
+    PHASE_SWAPPING,     // player swap (or bounce back) animating
+    PHASE_CLEARING,     // matched gems shrinking away
+    PHASE_FALLING,      // remaining gems dropping into holes, new gems dropping in from the top
+    PHASE_REFILLING,    // the opening board dropping in
+    PHASE_SHUFFLING,    // no legal swap was left, gems moving to a shuffled layout
+    PHASE_QUAKE         // 'q' held, random gems being knocked out
+};
+
+const char* phase_names[] = {"idle", "swapping", "clearing", "falling", "refilling", "shuffling", "quake"};
+
+
+
+// everything the renderer needs to draw one gem
+struct GemSprite {
+    int gem_type;
+    vec2 prev_position;     // position at the previous tick
+    vec2 position;
+    vec2 prev_scaling;
+    vec2 scaling;
+    bool draw_last;
+    float orientation;
+    float rotation_rate;
+};
+
+// immutable picture of the board after one simulation tick
+struct FrameSnapshot {
+    std::vector<GemSprite> sprites;
+    double time;            // time_glob of the tick
+    double published_at;    // wall clock when the simulation handed it over
+    GamePhase phase;
+    double input_arrived_at;    // arrival of the oldest input first shown by this frame, 0 if none
+    
+    FrameSnapshot() {
+        time = 0;
+        published_at = 0;
+        phase = PHASE_IDLE;
+        input_arrived_at = 0;
+    }
+};
+
+// one writer, one reader: the writer always has a slot to fill and the reader always holds a
+// complete frame, and neither side ever blocks the other
+template <typename T>
+class TripleBuffer {
+    static const int FRESH = 4;     // set on the middle index while it holds an unread frame
+    T slots[3];
+    std::atomic<int> middle;
+    int back;
+    int front;
+public:
+    TripleBuffer() : middle(1), back(0), front(2) {}
+    
+    // writer side
+    T& backBuffer() {
+        return slots[back];
+    }
+    
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+    
+    // the last published frame has not been taken yet. the reader may take it right after
+    bool unread() const {
+        return (middle.load(std::memory_order_acquire) & FRESH) != 0;
+    }
+    
+    // reader side: swap in the newest published frame, if there is one
+    bool update() {
+        if(!(middle.load(std::memory_order_acquire) & FRESH)) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+    
+    T& frontBuffer() {
+        return slots[front];
+    }
+};
+
+// bounded lock-free queue for exactly one producer thread and one consumer thread
+template <typename T, int Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+    T slots[Capacity];
+    std::atomic<unsigned int> head;     // next slot to pop, written by the consumer
+    std::atomic<unsigned int> tail;     // next slot to push, written by the producer
+public:
+    SpscQueue() : head(0), tail(0) {}
+    
+    // returns false and drops the item if the queue is full
+    bool push(const T& item) {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots[t & (Capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& item) {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+
+enum InputType {
+    INPUT_MOUSE_DOWN,
+    INPUT_MOUSE_UP,
+    INPUT_MOTION,
+    INPUT_KEY_DOWN,
+    INPUT_KEY_UP
+};
+
+// one GLUT input callback, captured on the GLUT thread and applied on the simulation thread
+struct InputEvent {
+    InputType type;
+    vec2 position;          // normalized device coordinates of the mouse
+    unsigned char key;
+    double arrived_at;      // wall clock when GLUT delivered it
+};
+
+
+// seed and tick-stamped input of one session, enough to play it again exactly: the simulation only
+// depends on the scene's seed, the fixed ticks and the input applied between them. binary layout in
+// host byte order: 'G', 'R', u8 version, u8 gem_types, u64 seed, u64 ticks, u32 count, then per event
+// u32 tick, u8 type, u8 key, f32 x, f32 y. RecordingView plays it back
+class InputRecording {
+public:
+    enum { version = 1, header_size = 24, event_size = 14 };
+    
+    struct Entry {
+        unsigned int tick;      // sim_tick the event was applied at, before that tick ran
+        InputEvent event;
+    };
+    
+    unsigned long long seed;
+    int gem_types;
+    long long ticks;            // length of the session
+    std::vector<Entry> entries;
+    
+    InputRecording(unsigned long long _seed = 0, int _gem_types = 0) {
+        seed = _seed;
+        gem_types = _gem_types;
+        ticks = 0;
+    }
+    
+    void add(long long tick, const InputEvent& event) {
+        Entry entry;
+        entry.tick = (unsigned int)tick;
+        entry.event = event;
+        entries.push_back(entry);
+    }
+    
+    // append the binary form to data
+    void serialize(std::vector<unsigned char>& data) const {
+        putBytes(data, (unsigned char)'G');
+        putBytes(data, (unsigned char)'R');
+        putBytes(data, (unsigned char)version);
+        putBytes(data, (unsigned char)gem_types);
+        putBytes(data, seed);
+        putBytes(data, ticks);
+        putBytes(data, (unsigned int)entries.size());
+        for(int k = 0; k < (int)entries.size(); k++) {
+            putBytes(data, entries[k].tick);
+            putBytes(data, (unsigned char)entries[k].event.type);
+            putBytes(data, entries[k].event.key);
+            putBytes(data, entries[k].event.position.x);
+            putBytes(data, entries[k].event.position.y);
+        }
+    }
+    
+    bool save(const char* path) const {
+        std::vector<unsigned char> data;
+        serialize(data);
+        FILE* file = fopen(path, "wb");
+        if(file == NULL) {
+            return false;
+        }
+        bool written = fwrite(&data[0], 1, data.size(), file) == data.size();
+        fclose(file);
+        return written;
+    }
+};
+
+// plays a recording back straight from its bytes, e.g. inside a mapped corpus: events are decoded one
+// at a time as their tick comes up, nothing is copied out beforehand. the bytes must outlive the view
+class RecordingView {
+    const unsigned char* events;
+    unsigned int count;
+    unsigned int cursor;    // next event to replay
+    
+public:
+    unsigned long long seed;
+    int gem_types;
+    long long ticks;
+    
+    RecordingView() {
+        events = nullptr;
+        count = 0;
+        cursor = 0;
+        seed = 0;
+        gem_types = 0;
+        ticks = 0;
+    }
+    
+    // false if data does not hold a whole recording, or its events are not in tick order, of a known type
+    // and on the board: positions are clamped to [-1, 1] when they are captured
+    bool open(const unsigned char* data, size_t size) {
+        const unsigned char* in = data;
+        const unsigned char* end = data + size;
+        unsigned char magic[2], file_version, types;
+        if(!getBytes(in, end, magic) || magic[0] != 'G' || magic[1] != 'R' || !getBytes(in, end, file_version) ||
+           file_version != InputRecording::version || !getBytes(in, end, types) || types < 3 ||
+           types > Board::max_gem_types || !getBytes(in, end, seed) ||
+           !getBytes(in, end, ticks) || !getBytes(in, end, count) ||
+           (size_t)(end - in) < (size_t)count*InputRecording::event_size) {
+            return false;
+        }
+        unsigned int last_tick = 0;
+        for(unsigned int e = 0; e < count; e++) {
+            const unsigned char* event = in + (size_t)e*InputRecording::event_size;
+            unsigned int event_tick;
+            float x, y;
+            memcpy(&event_tick, event, 4);
+            memcpy(&x, event + 6, 4);
+            memcpy(&y, event + 10, 4);
+            // written this way round so that NaN fails too
+            bool on_board = x >= -1 && x <= 1 && y >= -1 && y <= 1;
+            if(event_tick < last_tick || event[4] > INPUT_KEY_UP || !on_board) {
+                return false;
+            }
+            last_tick = event_tick;
+        }
+        gem_types = types;
+        events = in;
+        cursor = 0;
+        return true;
+    }
+    
+    // bytes the recording takes up from the data it was opened on
+    size_t size() const {
+        return InputRecording::header_size + (size_t)count*InputRecording::event_size;
+    }
+    
+    unsigned int inputs() const {
+        return count;
+    }
+    
+    // the next recorded event due at or before tick, if any are left; events are never skipped, one
+    // whose tick has already passed is handed out late rather than stalling the rest
+    bool next(long long tick, InputEvent& event) {
+        if(cursor == count) {
+            return false;
+        }
+        const unsigned char* in = events + (size_t)cursor*InputRecording::event_size;
+        unsigned int event_tick;
+        memcpy(&event_tick, in, 4);
+        if(event_tick > tick) {
+            return false;
+        }
+        event.type = (InputType)in[4];
+        event.key = in[5];
+        memcpy(&event.position.x, in + 6, 4);
+        memcpy(&event.position.y, in + 10, 4);
+        event.arrived_at = 0;
+        cursor++;
+        return true;
+    }
+};
+
+// whole file into memory, for the small files the game reads
+bool readFile(const char* path, std::vector<unsigned char>& data) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        return false;
+    }
+    data.clear();
+    unsigned char chunk[4096];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(file);
+    return true;
+}
+
+
+// many recordings in one append-only file, read through a memory map so replays decode events straight
+// from the page cache. layout: a header of 'G', 'C', 'I', 'X', u32 count and u64 offset of the current
+// index, then recordings and indexes of u64 offsets to them, in the order they were written. appending
+// writes the new recording and a longer index after everything in the file and only then points the
+// header at that index, so nothing written before is ever overwritten and a corpus cut short by a
+// crash still opens with the games it had. the index an append replaces stays behind in the file,
+// 8 bytes for every game in the corpus at the time
+class ReplayCorpus {
+    const unsigned char* data;
+    size_t data_size;
+    unsigned int count;
+    unsigned long long index_offset;
+    bool mapped;
+    std::vector<unsigned char> copy;    // used where mmap is not available
+    
+    enum { header_size = 16 };
+    
+    // index and count from the header of a corpus held in bytes
+    static bool readHeader(const unsigned char* bytes, size_t size, unsigned long long& offset, unsigned int& n) {
+        if(size < header_size || memcmp(bytes, "GCIX", 4) != 0) {
+            return false;
+        }
+        memcpy(&n, bytes + 4, 4);
+        memcpy(&offset, bytes + 8, 8);
+        return offset >= header_size && offset <= size && (size - offset) / 8 >= n;
+    }
+    
+public:
+    ReplayCorpus() {
+        data = nullptr;
+        data_size = 0;
+        count = 0;
+        index_offset = 0;
+        mapped = false;
+    }
+    
+    ~ReplayCorpus() {
+        close();
+    }
+    
+    bool open(const char* path) {
+        close();
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* view = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(view != MAP_FAILED) {
+                data = (const unsigned char*)view;
+                data_size = info.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+#endif
+        if(!mapped) {
+            if(!readFile(path, copy) || copy.empty()) {
+                return false;
+            }
+            data = &copy[0];
+            data_size = copy.size();
+        }
+        if(!readHeader(data, data_size, index_offset, count)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    
+    void close() {
+#if defined(__unix__) || defined(__APPLE__)
+        if(mapped) {
+            munmap((void*)data, data_size);
+        }
+#endif
+        mapped = false;
+        copy.clear();
+        data = nullptr;
+        data_size = 0;
+        count = 0;
+    }
+    
+    unsigned int size() const {
+        return count;
+    }
+    
+    // point view at game k, false if there is no such game or its bytes are not a recording
+    bool game(unsigned int k, RecordingView& view) const {
+        if(k >= count) {
+            return false;
+        }
+        unsigned long long offset;
+        memcpy(&offset, data + index_offset + 8ULL*k, 8);
+        return offset >= header_size && offset < data_size && view.open(data + offset, data_size - offset);
+    }
+    
+    // add one serialized recording, creating the corpus if there is none at path
+    static bool append(const char* path, const std::vector<unsigned char>& recording) {
+        std::vector<unsigned long long> offsets;
+        unsigned char header[header_size];
+        unsigned int n = 0;
+        memcpy(header, "GCIX", 4);
+        FILE* file = fopen(path, "r+b");
+        if(file != NULL) {
+            unsigned long long index = 0;
+            if(fread(header, 1, header_size, file) != header_size || memcmp(header, "GCIX", 4) != 0) {
+                fclose(file);
+                return false;
+            }
+            memcpy(&n, header + 4, 4);
+            memcpy(&index, header + 8, 8);
+            offsets.resize(n);
+            if(fseek(file, index, SEEK_SET) != 0 || fread(offsets.data(), 8, n, file) != n) {
+                fclose(file);
+                return false;
+            }
+        }
+        else {
+            file = fopen(path, "w+b");
+            if(file == NULL || fwrite(header, 1, header_size, file) != header_size) {
+                if(file != NULL) fclose(file);
+                return false;
+            }
+        }
+        if(fseek(file, 0, SEEK_END) != 0) {
+            fclose(file);
+            return false;
+        }
+        unsigned long long offset = ftell(file);
+        offsets.push_back(offset);
+        n++;
+        unsigned long long new_index = offset + recording.size();
+        // the recording and the index reach the file before the header points at them
+        bool written = fwrite(&recording[0], 1, recording.size(), file) == recording.size() &&
+                       fwrite(offsets.data(), 8, n, file) == n && fflush(file) == 0;
+        memcpy(header + 4, &n, 4);
+        memcpy(header + 8, &new_index, 8);
+        written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, header_size, file) == header_size;
+        return fclose(file) == 0 && written;
+    }
+};
+
+
+// histogram of input-to-photon latencies in 0.25 ms buckets, anything past the last bucket is clamped into it
+class LatencyHistogram {
+    static const int num_of_buckets = 1000;
+    static constexpr double bucket_width = 0.00025;
+    unsigned int buckets[num_of_buckets];
+    unsigned int count;
+    double max_latency;
+public:
+    LatencyHistogram() {
+        for(int i = 0; i < num_of_buckets; i++) buckets[i] = 0;
+        count = 0;
+        max_latency = 0;
+    }
+    
+    void add(double latency) {
+        int bucket = (int)(latency / bucket_width);
+        if(bucket < 0) { bucket = 0; }
+        if(bucket >= num_of_buckets) { bucket = num_of_buckets - 1; }
+        buckets[bucket]++;
+        count++;
+        if(latency > max_latency) { max_latency = latency; }
+    }
+    
+    // upper edge of the bucket holding the given fraction of samples, in seconds
+    double percentile(double p) {
+        unsigned int target = (unsigned int)ceil(p * count);
+        unsigned int seen = 0;
+        for(int i = 0; i < num_of_buckets; i++) {
+            seen += buckets[i];
+            if(seen >= target && seen > 0) {
+                return (i + 1) * bucket_width;
+            }
+        }
+        return max_latency;
+    }
+    
+    void report(const char* name) {
+        if(count == 0) {
+            printf("%s: no samples\n", name);
+            return;
+        }
+        printf("%s: %u samples, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, count,
+               percentile(0.5)*1000, percentile(0.9)*1000, percentile(0.99)*1000, max_latency*1000);
+    }
+};
+
+
+// build with -DGEMSWAP_PROFILE=0 to compile every PROFILE_SCOPE out
+#ifndef GEMSWAP_PROFILE
+#define GEMSWAP_PROFILE 1
+#endif
+
+// timed sections of the frame pipeline; the first six run on the simulation thread, the next three on the
+// render thread, and the gpu stages are timer queries read back by the render thread
+enum ProfileStage {
+    STAGE_TICK,
+    STAGE_REMOVALS,
+    STAGE_MOVEMENTS,
+    STAGE_REMOVE_LINES,
+    STAGE_SKYFALL,
+    STAGE_FILLGRID,
+    STAGE_UPDATE_GRID,
+    STAGE_DRAW,
+    STAGE_SWAP_BUFFERS,
+    STAGE_GPU_OPAQUE,
+    STAGE_GPU_DRAW_LAST,
+    num_of_stages
+};
+
+const char* stage_names[num_of_stages] = {"Tick", "processRemovals", "processMovements", "removeLines", "skyfall",
+                                          "fillgrid", "UpdateGrid", "Draw", "glutSwapBuffers", "gpu opaque", "gpu draw last"};
+
+// raw timestamp, tsc cycles where there is one and nanoseconds otherwise. Profiler calibrates it
+inline unsigned long long profileClock() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// one thread's stage timings. only the owning thread writes, so updates are plain loads and stores;
+// they are atomic so the overlay and the exit report can read them from another thread
+struct ProfileCounters {
+    // four buckets per power of two of the duration in clock units
+    static const int num_of_buckets = 64*4;
+    std::atomic<unsigned int> buckets[num_of_stages][num_of_buckets];
+    std::atomic<unsigned long long> calls[num_of_stages];
+    std::atomic<unsigned long long> total[num_of_stages];
+    std::atomic<unsigned long long> longest[num_of_stages];
+    
+    ProfileCounters() {
+        for(int s = 0; s < num_of_stages; s++) {
+            for(int b = 0; b < num_of_buckets; b++) buckets[s][b] = 0;
+            calls[s] = 0;
+            total[s] = 0;
+            longest[s] = 0;
+        }
+    }
+    
+    static int bucket(unsigned long long duration) {
+        if(duration < 4) {
+            return (int)duration;
+        }
+#if defined(__GNUC__)
+        int octave = 63 - __builtin_clzll(duration);
+#else
+        int octave = 2;
+        while(duration >> (octave + 1)) octave++;
+#endif
+        return octave*4 + (int)(duration >> (octave - 2) & 3);
+    }
+    
+    // smallest duration that falls in the bucket after b
+    static double bucketEnd(int b) {
+        if(b < 4) {
+            return b + 1;
+        }
+        return ldexp(1 + (b % 4 + 1)*0.25, b / 4);
+    }
+    
+    void add(int stage, unsigned long long duration) {
+        std::atomic<unsigned int>& b = buckets[stage][bucket(duration)];
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        calls[stage].store(calls[stage].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total[stage].store(total[stage].load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+        if(duration > longest[stage].load(std::memory_order_relaxed)) {
+            longest[stage].store(duration, std::memory_order_relaxed);
+        }
+    }
+};
+
+// per-stage histograms of every thread that ran a PROFILE_SCOPE, merged when read
+class Profiler {
+    std::mutex mutex;
+    std::vector<ProfileCounters*> threads;
+    unsigned long long start_clock;
+    std::chrono::steady_clock::time_point start_time;
+public:
+    Profiler() {
+        start_clock = profileClock();
+        start_time = std::chrono::steady_clock::now();
+    }
+    
+    ~Profiler() {
+        for(int i = 0; i < (int)threads.size(); i++) delete threads[i];
+    }
+    
+    // the calling thread's counters, registered the first time it asks; they outlive the thread
+    ProfileCounters& local() {
+        thread_local ProfileCounters* counters = nullptr;
+        if(counters == nullptr) {
+            counters = new ProfileCounters();
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(counters);
+        }
+        return *counters;
+    }
+    
+    // seconds per clock unit, measured against the steady clock since startup
+    double secondsPerUnit() {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        unsigned long long units = profileClock() - start_clock;
+        return units > 0 ? elapsed / units : 1e-9;
+    }
+    
+    // for durations measured elsewhere, e.g. on the GPU
+    void addSeconds(int stage, double seconds) {
+        local().add(stage, (unsigned long long)(seconds / secondsPerUnit()));
+    }
+    
+    // summed over threads: calls and total clock units of one stage
+    void totals(int stage, unsigned long long& calls, unsigned long long& total) {
+        std::lock_guard<std::mutex> lock(mutex);
+        calls = 0;
+        total = 0;
+        for(int i = 0; i < (int)threads.size(); i++) {
+            calls += threads[i]->calls[stage].load(std::memory_order_relaxed);
+            total += threads[i]->total[stage].load(std::memory_order_relaxed);
+        }
+    }
+    
+    void report() {
+        double unit = secondsPerUnit() * 1e6;
+        std::lock_guard<std::mutex> lock(mutex);
+        bool header = false;
+        for(int s = 0; s < num_of_stages; s++) {
+            std::vector<unsigned long long> merged(ProfileCounters::num_of_buckets, 0);
+            unsigned long long calls = 0, total = 0, longest = 0;
+            for(int i = 0; i < (int)threads.size(); i++) {
+                for(int b = 0; b < ProfileCounters::num_of_buckets; b++) {
+                    merged[b] += threads[i]->buckets[s][b].load(std::memory_order_relaxed);
+                }
+                calls += threads[i]->calls[s].load(std::memory_order_relaxed);
+                total += threads[i]->total[s].load(std::memory_order_relaxed);
+                longest = std::max(longest, threads[i]->longest[s].load(std::memory_order_relaxed));
+            }
+            if(calls == 0) {
+                continue;
+            }
+            if(!header) {
+                printf("%-17s %10s %10s %9s %9s %9s %9s %9s\n", "stage", "calls", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+                header = true;
+            }
+            double p[3] = {0.5, 0.9, 0.99};
+            double at[3] = {0, 0, 0};
+            for(int q = 0; q < 3; q++) {
+                unsigned long long target = (unsigned long long)ceil(p[q] * calls), seen = 0;
+                for(int b = 0; b < ProfileCounters::num_of_buckets; b++) {
+                    seen += merged[b];
+                    if(seen >= target) {
+                        at[q] = std::min(ProfileCounters::bucketEnd(b), (double)longest) * unit;
+                        break;
+                    }
+                }
+            }
+            printf("%-17s %10llu %10.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n", stage_names[s], calls, total * unit / 1000,
+                   total * unit / calls, at[0], at[1], at[2], longest * unit);
+        }
+    }
+};
+
+Profiler profiler;
+
+// a scope costs two clock reads, tens of ns, which is lost in a frame but not in a headless tick of
+// a few hundred ns: the window always profiles, headless modes only with --profile. set before any
+// thread starts
+bool profiling = false;
+
+// times the rest of the enclosing block into a stage
+class ProfileScope {
+    int stage;
+    unsigned long long start;
+public:
+    ProfileScope(int _stage) : stage(_stage), start(profiling ? profileClock() : 0) {}
+    ~ProfileScope() {
+        if(profiling) {
+            profiler.local().add(stage, profileClock() - start);
+        }
+    }
+};
+
+#if GEMSWAP_PROFILE
+#define PROFILE_SCOPE(stage) ProfileScope profile_scope(stage)
+#else
+#define PROFILE_SCOPE(stage)
+#endif
+
+
+enum GameEventType {
+    EVENT_SWAP,         // player swap from one cell to the other, value 1 if legal, 0 if it bounced back
+    EVENT_BOMB,         // 'b' held and a gem clicked away
+    EVENT_QUAKE,        // one quake tick, value is the number of gems it knocked out
+    EVENT_MATCH,        // run from one cell to the other cleared by removeLines, value is the cascade depth
+    EVENT_REMOVE,       // one gem taken off the grid
+    EVENT_CASCADE       // board came to rest after value rounds of matches
+};
+
+// one analytics event, kept small so emitting it is a copy into the ring
+struct GameEvent {
+    unsigned int tick;
+    unsigned char type;
+    unsigned char gem_type;
+    unsigned char i, j;
+    unsigned char to_i, to_j;
+    unsigned short value;
+};
+
+// line-delimited JSON event stream. the simulation thread emits into a lock-free ring and never waits;
+// a background thread drains it to the file. events that find the ring full are counted and dropped
+class EventLog {
+    static const int capacity = 4096;
+    SpscQueue<GameEvent, capacity> queue;
+    FILE* file;
+    std::thread* writer;
+    std::atomic<bool> running;
+    unsigned int dropped;
+    unsigned long long written;
+
+    // write out everything queued so far, return false if there was nothing
+    bool drain() {
+        static const char* names[] = {"swap", "bomb", "quake", "match", "remove", "cascade"};
+        GameEvent e;
+        bool any = false;
+        while(queue.pop(e)) {
+            fprintf(file, "{\"tick\":%u,\"event\":\"%s\"", e.tick, names[e.type]);
+            switch(e.type) {
+                case EVENT_SWAP:
+                    fprintf(file, ",\"gem\":%d,\"from\":[%d,%d],\"to\":[%d,%d],\"legal\":%s", e.gem_type, e.i, e.j, e.to_i, e.to_j, e.value ? "true" : "false");
+                    break;
+                case EVENT_BOMB:
+                case EVENT_REMOVE:
+                    fprintf(file, ",\"gem\":%d,\"cell\":[%d,%d]", e.gem_type, e.i, e.j);
+                    break;
+                case EVENT_QUAKE:
+                    fprintf(file, ",\"knocked_out\":%d", e.value);
+                    break;
+                case EVENT_MATCH:
+                    fprintf(file, ",\"gem\":%d,\"from\":[%d,%d],\"to\":[%d,%d],\"length\":%d,\"depth\":%d", e.gem_type, e.i, e.j, e.to_i, e.to_j,
+                            e.to_i - e.i + e.to_j - e.j + 1, e.value);
+                    break;
+                case EVENT_CASCADE:
+                    fprintf(file, ",\"depth\":%d", e.value);
+                    break;
+            }
+            fprintf(file, "}\n");
+            written++;
+            any = true;
+        }
+        return any;
+    }
+
+    void writerLoop() {
+        while(running) {
+            if(!drain()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        drain();
+    }
+
+public:
+    EventLog() : file(NULL), writer(nullptr), running(false), dropped(0), written(0) {}
+
+    ~EventLog() {
+        close();
+    }
+
+    bool open(const char* path) {
+        file = fopen(path, "w");
+        if(file == NULL) {
+            return false;
+        }
+        running = true;
+        writer = new std::thread(&EventLog::writerLoop, this);
+        return true;
+    }
+
+    bool isOpen() {
+        return writer != nullptr;
+    }
+    
+    // producer side, only ever called from the thread running the scene
+    void emit(const GameEvent& event) {
+        if(!queue.push(event)) {
+            dropped++;
+        }
+    }
+
+    // call once the producer is done; writes out what is still queued
+    void close() {
+        if(writer == nullptr) {
+            return;
+        }
+        running = false;
+        writer->join();
+        delete writer;
+        writer = nullptr;
+        fclose(file);
+        file = NULL;
+        if(dropped > 0) {
+            printf("event log: %llu events written, %u dropped\n", written, dropped);
+        }
+    }
+};
+
+
+
+// board simulation: grid, rules and animation state, no GL
+class Scene {
+    // deque so that grid and removal pointers stay valid when gems are spawned
+    std::deque<GameObject> gameObjects;
+    
+    // finished movement and removal records and the gems of finished removals, reused before anything
+    // new is allocated. once the opening board has settled, play stays within what the pools and the
+    // reserved vectors hold and the rules stop allocating
+    std::vector<Movement*> spare_movements;
+    std::vector<Removal*> spare_removals;
+    std::vector<GameObject*> spare_objects;
+    Board mirror;       // gem types on the grid, changed along with it, for the rules' checks and the spawn policy
+
+public:
+    std::vector<std::vector<GameObject*>> grid;
+    int gem_types;
+    int num_of_rows = 10;
+    int num_of_cols = 10;
+    
+    std::vector<Movement*> movements;
+    std::vector<Removal*> removals;
+
+    GamePhase phase = PHASE_REFILLING;
+    
+    GemRng rng;
+    SpawnPolicy* spawn_policy;      // owned, picks the gems fillgrid drops in
+    
+    // pointer and key state of the player driving this scene, see applyInput
+    vec2 selected_grid_cell;
+    bool b_pressed = false;
+    
+    EventLog* events = nullptr;     // not owned, analytics go nowhere without one
+    int cascade_depth = 0;          // rounds of matches since the board was last at rest
+    
+    enum { snapshot_version = 2 };
+
+    // the seed fixes every gem the scene will ever spawn, see InputRecording
+    Scene(int _gem_types, unsigned long long seed) {
+        gem_types = _gem_types;
+        rng = GemRng(seed);
+        spawn_policy = new AntiDeadlockSpawn();
+        // every cell can be falling and have a removal at once, and a refused swap adds four movements
+        int cells = num_of_cols*num_of_rows;
+        movements.reserve(cells + 4);
+        spare_movements.reserve(cells + 4);
+        removals.reserve(cells);
+        spare_removals.reserve(cells);
+        spare_objects.reserve(cells);
+        for(int r = 0; r < cells; r++) {
+            spare_removals.push_back(new Removal(nullptr, 0, 0));
+        }
+        mirror = Board(num_of_cols, num_of_rows, gem_types);
+        InitializeGrid();
+    }
+    
+    ~Scene() {
+        for(int i = 0; i < (int)movements.size(); i++) delete movements[i];
+        for(int i = 0; i < (int)removals.size(); i++) delete removals[i];
+        for(int i = 0; i < (int)spare_movements.size(); i++) delete spare_movements[i];
+        for(int i = 0; i < (int)spare_removals.size(); i++) delete spare_removals[i];
+        delete spawn_policy;
+    }
+    
+    // the opening board has no free matches and, all but always, a legal swap; one drawn without is
+    // shuffled once the board comes to rest
+    void InitializeGrid() {
+        Board& board = mirror;
+        board.generate(rng);
+        for(int k = 0; k < num_of_cols*num_of_rows; k++) {
+            addGameObject(board.at(k % 10, k / 10));
+        }
+        for(int i = 0; i < num_of_rows; i++) {
+            std::vector<GameObject*> row;
+            for(int j = 0; j < num_of_cols; j++) {
+                row.push_back(&gameObjects[i+10*j]);
+                row.at(j)->set_in_grid(true);
+                vec2 cell = vec2(i,j);
+                addMovement(cell,grid_to_coords(vec2(i,j+10)), grid_to_coords(cell), time_glob, time_glob + 3*move_time);
+                gameObjects[i+10*j].setPosition(grid_to_coords(vec2(i,j+10)));
+            }
+            grid.push_back(row);
+        }
+        //skyfall();
+    }
+    
+    GameObject* addGameObject(int gem_type) {
+        int rotation_rate = 0;
+        if(gem_type == 1) {rotation_rate = 10;}
+        if(gem_type == 6) {rotation_rate = 40;}
+        if(gem_type == 7) {rotation_rate = -20;}
+        if(!spare_objects.empty()) {
+            GameObject* gameObject = spare_objects.back();
+            spare_objects.pop_back();
+            *gameObject = GameObject(gem_type, vec2(0,0), 0, rotation_rate);
+            return gameObject;
+        }
+        gameObjects.push_back(GameObject(gem_type, vec2(0,0), 0, rotation_rate));
+        return &gameObjects.back();
+    }
+    
+    void addMovement(vec2 cell, vec2 start_loc, vec2 end_loc, double start_t, double end_t) {
+        if(spare_movements.empty()) {
+            movements.push_back(new Movement(cell, start_loc, end_loc, start_t, end_t));
+            return;
+        }
+        Movement* movement = spare_movements.back();
+        spare_movements.pop_back();
+        *movement = Movement(cell, start_loc, end_loc, start_t, end_t);
+        movements.push_back(movement);
+    }
+    
+    Removal* addRemoval(GameObject* gameObject, double start_t, double end_t) {
+        Removal* removal;
+        if(spare_removals.empty()) {
+            removal = new Removal(gameObject, start_t, end_t);
+        }
+        else {
+            removal = spare_removals.back();
+            spare_removals.pop_back();
+            *removal = Removal(gameObject, start_t, end_t);
+        }
+        removals.push_back(removal);
+        return removal;
+    }
+    
+    GemSprite sprite(GameObject* gameObject, vec2 position, bool draw_last) {
+        GemSprite s;
+        s.gem_type = gameObject->getType();
+        s.prev_position = position;
+        s.position = position;
+        s.scaling = vec2(gameObject->scaling/num_of_rows, gameObject->scaling/num_of_cols);
+        s.prev_scaling = vec2(gameObject->prev_scaling/num_of_rows, gameObject->prev_scaling/num_of_cols);
+        s.draw_last = draw_last;
+        s.orientation = gameObject->getOrientation();
+        s.rotation_rate = gameObject->getRotationRate();
+        if(draw_last) {
+            s.prev_position = gameObject->getPrevPosition();
+            s.position = gameObject->getPosition();
+        }
+        return s;
+    }
+    
+    // write the drawable state of the board into frame, reusing its storage
+    void UpdateGrid(FrameSnapshot& frame) {
+        PROFILE_SCOPE(STAGE_UPDATE_GRID);
+        frame.sprites.clear();
+        for(int i = 0; i < grid.size(); i++) {
+            for(int j = 0; j < grid[0].size(); j++) {
+                GameObject* gameObject = grid.at(i).at(j);
+                if(gameObject != nullptr) {
+                    frame.sprites.push_back(sprite(gameObject, grid_to_coords(vec2(i, j)), gameObject->isInMotion()));
+                }
+            }
+        }
+        for (int i = 0; i < removals.size(); i++) {
+            GameObject* gameObject = removals[i]->gameObject;
+            if(gameObject != nullptr) {
+                frame.sprites.push_back(sprite(gameObject, gameObject->getPosition(), true));
+            }
+        }
+        frame.time = time_glob;
+        frame.phase = phase;
+    }
+    
+    
+    // the cell under a point of the board, the nearest one for points on or past its edge
+    vec2 coords_to_grid(vec2 loc) {
+        int i = (int)((std::max(-1.0f, std::min(loc.x, 1.0f)) + 1)*5);
+        int j = (int)((std::max(-1.0f, std::min(loc.y, 1.0f)) + 1)*5);
+        return vec2(std::min(i, num_of_cols - 1), std::min(j, num_of_rows - 1));
+    }
+    
+    vec2 grid_to_coords(vec2 cell) {
+        double x = cell.x/5.0-0.9;
+        double y = cell.y/5.0-0.9;
+        return vec2(x,y);
+    }
+    
+    
+    // snapshot of everything the simulation needs to carry on exactly where it was: the clock, phase and
+    // rng, the player's pointer and key state, the depth of a cascade in progress, the gem type of every
+    // cell at 4 bits each, and the pending animations. gems at rest are
+    // rebuilt from their type alone, so only moving and shrinking ones carry positions. the spawn policy
+    // is configuration and is not saved. host byte order; out is cleared, its storage reused
+    void save(std::vector<unsigned char>& out) {
+        out.clear();
+        putBytes(out, (unsigned char)'G');
+        putBytes(out, (unsigned char)'S');
+        putBytes(out, (unsigned char)snapshot_version);
+        putBytes(out, (unsigned char)phase);
+        putBytes(out, (unsigned char)gem_types);
+        putBytes(out, (unsigned char)num_of_cols);
+        putBytes(out, (unsigned char)num_of_rows);
+        putBytes(out, sim_tick);
+        putBytes(out, time_glob);
+        putBytes(out, rng.getState());
+        putBytes(out, selected_grid_cell);
+        putBytes(out, (unsigned char)b_pressed);
+        putBytes(out, cascade_depth);
+        
+        unsigned char packed = 0;
+        unsigned short moving = 0;
+        for(int k = 0; k < num_of_cols*num_of_rows; k++) {
+            GameObject* gameObject = grid[k / num_of_rows][k % num_of_rows];
+            int nibble = gameObject != nullptr ? gameObject->getType() : 15;
+            if(k % 2 == 0) {
+                packed = nibble;
+            }
+            else {
+                putBytes(out, (unsigned char)(packed | nibble << 4));
+            }
+            if(gameObject != nullptr && gameObject->isInMotion()) {
+                moving++;
+            }
+        }
+        if(num_of_cols*num_of_rows % 2) {
+            putBytes(out, packed);
+        }
+        
+        putBytes(out, moving);
+        for(int k = 0; k < num_of_cols*num_of_rows; k++) {
+            GameObject* gameObject = grid[k / num_of_rows][k % num_of_rows];
+            if(gameObject != nullptr && gameObject->isInMotion()) {
+                putBytes(out, (unsigned short)k);
+                putObject(out, gameObject);
+            }
+        }
+        unsigned short shrinking = 0;
+        for(int i = 0; i < (int)removals.size(); i++) {
+            if(removals[i]->gameObject != nullptr) shrinking++;
+        }
+        putBytes(out, shrinking);
+        for(int i = 0; i < (int)removals.size(); i++) {
+            if(removals[i]->gameObject != nullptr) {
+                putBytes(out, (unsigned char)removals[i]->gameObject->getType());
+                putObject(out, removals[i]->gameObject);
+                putBytes(out, removals[i]->start_t);
+                putBytes(out, removals[i]->end_t);
+            }
+        }
+        putBytes(out, (unsigned short)movements.size());
+        for(int i = 0; i < (int)movements.size(); i++) {
+            Movement* m = movements[i];
+            putBytes(out, (unsigned short)(m->cell.x*num_of_rows + m->cell.y));
+            putBytes(out, m->start_loc);
+            putBytes(out, m->end_loc);
+            putBytes(out, m->start_t);
+            putBytes(out, m->end_t);
+        }
+    }
+    
+    // go back to a snapshot written by save, including the simulation clock. returns false and leaves
+    // the scene alone if the data is not a snapshot of this version and board size, or if any record in
+    // it is out of range
+    bool restore(const unsigned char* data, size_t size) {
+        const unsigned char* end = data + size;
+        const int cells = num_of_cols*num_of_rows;
+        const size_t fields = 7 + 8 + 8 + 8 + 8 + 1 + 4;
+        const size_t header = fields + (cells + 1)/2;
+        bool valid = size >= header && data[0] == 'G' && data[1] == 'S' && data[2] == snapshot_version &&
+                     data[3] <= PHASE_QUAKE && data[4] == gem_types && data[5] == num_of_cols && data[6] == num_of_rows;
+        auto nibbleAt = [&](int c) {
+            return data[fields + c/2] >> (c % 2 * 4) & 15;
+        };
+        // the selected cell is indexed straight into the grid by applyInput
+        vec2 selected;
+        unsigned char pressed = 0;
+        int depth = 0;
+        if(valid) {
+            const unsigned char* player = data + 7 + 8 + 8 + 8;
+            getBytes(player, end, selected);
+            getBytes(player, end, pressed);
+            getBytes(player, end, depth);
+            valid = selected.x >= 0 && selected.x < num_of_cols && selected.y >= 0 && selected.y < num_of_rows &&
+                    selected.x == (int)selected.x && selected.y == (int)selected.y && pressed <= 1 && depth >= 0;
+        }
+        // walk every record once before touching anything: gem types must be ones the scene has, and
+        // cell indices must be on the board, on a gem for the moving ones
+        for(int c = 0; c < cells && valid; c++) {
+            valid = nibbleAt(c) == 15 || nibbleAt(c) < gem_types;
+        }
+        const unsigned char* in = data + header;
+        unsigned short count = 0;
+        unsigned short k = 0;
+        unsigned char gem_type = 0;
+        valid = valid && getBytes(in, end, count);
+        for(int r = 0; r < count && valid; r++) {
+            valid = getBytes(in, end, k) && k < cells && nibbleAt(k) != 15 && (size_t)(end - in) >= object_record;
+            in += valid ? object_record : 0;
+        }
+        valid = valid && getBytes(in, end, count);
+        for(int r = 0; r < count && valid; r++) {
+            valid = getBytes(in, end, gem_type) && gem_type < gem_types && (size_t)(end - in) >= object_record + 16;
+            in += valid ? object_record + 16 : 0;
+        }
+        valid = valid && getBytes(in, end, count);
+        for(int r = 0; r < count && valid; r++) {
+            valid = getBytes(in, end, k) && k < cells && (size_t)(end - in) >= 8 + 8 + 16;
+            in += valid ? 8 + 8 + 16 : 0;
+        }
+        if(!valid) {
+            return false;
+        }
+        
+        spare_movements.insert(spare_movements.end(), movements.begin(), movements.end());
+        spare_removals.insert(spare_removals.end(), removals.begin(), removals.end());
+        movements.clear();
+        removals.clear();
+        gameObjects.clear();
+        spare_objects.clear();
+        
+        in = data + 7;
+        unsigned long long rng_state = 0;
+        getBytes(in, end, sim_tick);
+        getBytes(in, end, time_glob);
+        getBytes(in, end, rng_state);
+        phase = (GamePhase)data[3];
+        rng = GemRng(rng_state);
+        selected_grid_cell = selected;
+        b_pressed = pressed != 0;
+        cascade_depth = depth;
+        for(int c = 0; c < cells; c++) {
+            int nibble = nibbleAt(c);
+            GameObject*& cell = grid[c / num_of_rows][c % num_of_rows];
+            cell = nullptr;
+            if(nibble != 15) {
+                cell = addGameObject(nibble);
+                cell->set_in_grid(true);
+            }
+        }
+        toBoard(mirror);
+        in = data + header;
+        
+        getBytes(in, end, count);
+        for(int r = 0; r < count; r++) {
+            getBytes(in, end, k);
+            getObject(in, end, grid[k / num_of_rows][k % num_of_rows]);
+        }
+        getBytes(in, end, count);
+        for(int r = 0; r < count; r++) {
+            getBytes(in, end, gem_type);
+            GameObject* gameObject = addGameObject(gem_type);
+            gameObject->set_in_grid(false);
+            getObject(in, end, gameObject);
+            Removal* removal = addRemoval(gameObject, 0, 0);
+            getBytes(in, end, removal->start_t);
+            getBytes(in, end, removal->end_t);
+            gameObject->removal_start_t = removal->start_t;
+            gameObject->removal_end_t = removal->end_t;
+        }
+        getBytes(in, end, count);
+        for(int r = 0; r < count; r++) {
+            getBytes(in, end, k);
+            addMovement(vec2(k / num_of_rows, k % num_of_rows), vec2(), vec2(), 0, 0);
+            Movement* m = movements.back();
+            getBytes(in, end, m->start_loc);
+            getBytes(in, end, m->end_loc);
+            getBytes(in, end, m->start_t);
+            getBytes(in, end, m->end_t);
+        }
+        return true;
+    }
+    
+    // position, previous position and scalings of a gem in motion
+    enum { object_record = 24 };
+    
+    void putObject(std::vector<unsigned char>& out, GameObject* gameObject) {
+        putBytes(out, gameObject->getPosition());
+        putBytes(out, gameObject->getPrevPosition());
+        putBytes(out, (float)gameObject->scaling);
+        putBytes(out, (float)gameObject->prev_scaling);
+    }
+    
+    void getObject(const unsigned char*& in, const unsigned char* end, GameObject* gameObject) {
+        vec2 position, prev_position;
+        float scaling, prev_scaling;
+        getBytes(in, end, position);
+        getBytes(in, end, prev_position);
+        getBytes(in, end, scaling);
+        getBytes(in, end, prev_scaling);
+        gameObject->warpPosition(prev_position);
+        gameObject->setPosition(position);
+        gameObject->scaling = scaling;
+        gameObject->prev_scaling = prev_scaling;
+    }
+    
+    // gem types currently on the grid, for the solver
+    Board toBoard() {
+        Board board(num_of_cols, num_of_rows, gem_types);
+        toBoard(board);
+        return board;
+    }
+    
+    // the same into a board of the grid's size, reusing its storage
+    void toBoard(Board& board) {
+        board.clear();
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                if(grid[i][j] != nullptr) {
+                    board.set(i, j, grid[i][j]->getType());
+                }
+            }
+        }
+    }
+    
+    bool hasLegalMove() {
+        return mirror.hasLegalMove();
+    }
+    
+    void swap(vec2 cell1, vec2 cell2) {
+        GameObject* temp = grid[cell1.x][cell1.y];
+        grid[cell1.x][cell1.y] = grid[cell2.x][cell2.y];
+        grid[cell2.x][cell2.y] = temp;
+        mirror.swap(cell1.x, cell1.y, cell2.x, cell2.y);
+    }
+    
+    // take a removed gem off the grid
+    void empty_cell(vec2 cell) {
+        grid[cell.x][cell.y] = nullptr;
+        mirror.set(cell.x, cell.y, Board::EMPTY);
+    }
+    
+    bool isLegalMove(vec2 cell1, vec2 cell2) {
+        swap(cell1, cell2);
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                if(grid[i][j] != nullptr) {
+                    int x = i + 1;
+                    while(x < num_of_cols) {
+                        if(grid[x][j] == nullptr || grid[i][j]->getType() != grid[x][j]->getType()) {
+                            break;
+                        }
+                        x++;
+                    }
+                    if(x-i >= 3) {
+                        swap(cell1, cell2);
+                        return true;
+                    }
+                    int y = j + 1;
+                    while(y < num_of_cols) {
+                        if(grid[i][y] == nullptr || grid[i][j]->getType() != grid[i][y]->getType()) {
+                            break;
+                        }
+                        y++;
+                    }
+                    if(y-j >= 3) {
+                        swap(cell1, cell2);
+                        return true;
+                    }
+                }
+            }
+        }
+        swap(cell1, cell2);
+        return false;
+    }
+    
+    
+    void emit(GameEventType type, int gem_type, vec2 cell, vec2 to, int value) {
+        if(events == nullptr) {
+            return;
+        }
+        GameEvent event;
+        event.tick = (unsigned int)sim_tick;
+        event.type = type;
+        event.gem_type = gem_type;
+        event.i = cell.x;
+        event.j = cell.y;
+        event.to_i = to.x;
+        event.to_j = to.y;
+        event.value = value;
+        events->emit(event);
+    }
+    
+    bool removeLines() {
+        PROFILE_SCOPE(STAGE_REMOVE_LINES);
+        bool lines_found = false;
+        int depth = cascade_depth + 1;
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                if(grid[i][j] != nullptr) {
+                    int x = i + 1;
+                    while(x < num_of_cols) {
+                        if(grid[x][j] == nullptr || grid[i][j]->getType() != grid[x][j]->getType()) {
+                            break;
+                        }
+                        x++;
+                    }
+                    if(x-i >= 3) {
+                        lines_found = true;
+                        emit(EVENT_MATCH, grid[i][j]->getType(), vec2(i,j), vec2(x-1,j), depth);
+                        for (int a = i; a < x; a++) {
+                            remove_cell(vec2(a,j));
+                        }
+                    }
+                    int y = j + 1;
+                    while(y < num_of_cols) {
+                        if(grid[i][y] == nullptr || grid[i][j]->getType() != grid[i][y]->getType()) {
+                            break;
+                        }
+                        y++;
+                    }
+                    if(y-j >= 3) {
+                        lines_found = true;
+                        emit(EVENT_MATCH, grid[i][j]->getType(), vec2(i,j), vec2(i,y-1), depth);
+                        for (int b = j; b < y; b++) {
+                            remove_cell(vec2(i,b));
+                        }
+                    }
+                }
+            }
+        }
+        if(lines_found) {
+            cascade_depth = depth;
+            for(int i = 0; i < num_of_cols; i++) {
+                for(int j = 0; j < num_of_rows; j++) {
+                    if(grid[i][j] != nullptr && !grid[i][j]->is_in_grid()) {
+                        empty_cell(vec2(i,j));
+                    }
+                }
+            }
+        }
+        return lines_found;
+    }
+    
+    void remove_cell(vec2 cell) {
+        // a gem in both a row and a column run is removed once, its record and object are reused once
+        if(!grid[cell.x][cell.y]->is_in_grid()) {
+            return;
+        }
+        emit(EVENT_REMOVE, grid[cell.x][cell.y]->getType(), cell, cell, 0);
+        grid[cell.x][cell.y]->setPosition(grid_to_coords(vec2(cell.x,cell.y)));
+        addRemoval(grid[cell.x][cell.y], time_glob, time_glob+remove_time);
+        grid[cell.x][cell.y]->set_in_grid(false);
+
+    }
+    
+    // return true while some removed cell is still shrinking
+    bool processRemovals() {
+        PROFILE_SCOPE(STAGE_REMOVALS);
+        for(int i = 0; i < (int)removals.size(); i++) {
+            Removal* r = removals[i];
+            GameObject* gameObject = r->gameObject;
+            if(gameObject != nullptr) {
+                if (time_glob >= r->start_t && time_glob <= r->end_t) {
+                    double scaling = (r->end_t - time_glob)/(r->end_t - r->start_t);
+                    gameObject->scaling = scaling;
+                } else if( time_glob > r->end_t ){
+                    removals.erase(removals.begin() + i);
+                    i--;
+                    spare_removals.push_back(r);
+                    spare_objects.push_back(gameObject);
+                }
+            }
+        }
+        return removals.size() != 0;
+    }
+
+    // return true while some cell is still moving
+    bool processMovements() {
+        PROFILE_SCOPE(STAGE_MOVEMENTS);
+        for(int i = 0; i < (int)movements.size(); i++) {
+            Movement* movement = movements[i];
+            if(movement->start_t == -1) {
+                movement->start_t = time_glob;
+                movement->end_t = time_glob + move_time;
+            }
+            if(time_glob >= movement->start_t && time_glob <= movement->end_t) {
+                move_object(movement, time_glob);
+            }
+            else if(time_glob > movement->end_t) {
+                if(grid[movement->cell.x][movement->cell.y] != nullptr) {
+                    stop_motion(movement->cell);
+                }
+                movements.erase(movements.begin() + i);
+                i--;
+                spare_movements.push_back(movement);
+            }
+        }
+        return movements.size() != 0;
+    }
+
+    bool acceptsInput() {
+        return phase == PHASE_IDLE;
+    }
+
+    void setPhase(GamePhase _phase) {
+        phase = _phase;
+    }
+
+    // board has come to rest: clear new lines, shuffle a deadlocked board, or wait for input
+    void settle() {
+        if(removeLines()) {
+            setPhase(PHASE_CLEARING);
+        }
+        else if(!hasLegalMove() && shuffleGrid()) {
+            setPhase(PHASE_SHUFFLING);
+        }
+        else {
+            if(cascade_depth > 0) {
+                emit(EVENT_CASCADE, 0, vec2(), vec2(), cascade_depth);
+                cascade_depth = 0;
+            }
+            setPhase(PHASE_IDLE);
+        }
+    }
+    
+    // deal the gems out again into a layout with no runs and a legal swap, and send each one
+    // gliding to its new cell. gems whose cell keeps its type stay put
+    bool shuffleGrid() {
+        Board& board = mirror;
+        if(!board.shuffle(rng)) {
+            return false;
+        }
+        std::vector<std::vector<vec2> > from(gem_types);
+        std::vector<std::vector<GameObject*> > moving(gem_types);
+        std::vector<std::vector<GameObject*> > old_grid = grid;
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                int gem_type = old_grid[i][j]->getType();
+                if(board.at(i, j) != gem_type) {
+                    from[gem_type].push_back(vec2(i,j));
+                    moving[gem_type].push_back(old_grid[i][j]);
+                }
+            }
+        }
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows; j++) {
+                int gem_type = board.at(i, j);
+                if(old_grid[i][j]->getType() == gem_type) {
+                    continue;
+                }
+                grid[i][j] = moving[gem_type].back();
+                addMovement(vec2(i,j), grid_to_coords(from[gem_type].back()), grid_to_coords(vec2(i,j)), time_glob, time_glob + 3*move_time);
+                set_cell_position(vec2(i,j), grid_to_coords(from[gem_type].back()));
+                moving[gem_type].pop_back();
+                from[gem_type].pop_back();
+            }
+        }
+        return true;
+    }
+
+    // remember where every animated object was before this tick so the renderer can interpolate
+    void saveState() {
+        for(int i = 0; i < (int)grid.size(); i++) {
+            for(int j = 0; j < (int)grid[i].size(); j++) {
+                if(grid[i][j] != nullptr) {
+                    grid[i][j]->saveState();
+                }
+            }
+        }
+        for(int i = 0; i < (int)removals.size(); i++) {
+            removals[i]->gameObject->saveState();
+        }
+    }
+    
+    // one fixed simulation tick at time_glob
+    bool Tick() {
+        if(phase == PHASE_IDLE) {
+            return false;
+        }
+        PROFILE_SCOPE(STAGE_TICK);
+        AllocScope alloc_scope(ALLOC_RULES);
+        saveState();
+        return Step();
+    }
+    
+    // advance the current phase by one tick, return true if anything on the board changed
+    bool Step() {
+        switch(phase) {
+            case PHASE_IDLE:
+                return false;
+            case PHASE_SWAPPING:
+                if(!processMovements()) {
+                    settle();
+                }
+                return true;
+            case PHASE_CLEARING:
+                if(!processRemovals()) {
+                    // new gems drop in alongside the ones falling into the holes
+                    skyfall();
+                    fillgrid();
+                    setPhase(PHASE_FALLING);
+                }
+                return true;
+            case PHASE_FALLING:
+            case PHASE_REFILLING:
+            case PHASE_SHUFFLING:
+                if(!processMovements()) {
+                    settle();
+                }
+                return true;
+            case PHASE_QUAKE:
+                processRemovals();
+                return true;
+        }
+        return false;
+    }
+    
+    void processQuake() {
+        int knocked_out = 0;
+        for(int i = 0; i < grid.size(); i++) {
+            for(int j = 0; j < grid[0].size(); j++) {
+                if(grid.at(i).at(j) != nullptr && rng.below(1000) == 0 ) {
+                    remove_cell(vec2(i,j));
+                    empty_cell(vec2(i,j));
+                    knocked_out++;
+                }
+            }
+        }
+        emit(EVENT_QUAKE, 0, vec2(), vec2(), knocked_out);
+    }
+    
+    void skyfall() {
+        PROFILE_SCOPE(STAGE_SKYFALL);
+        for(int i = 0; i < num_of_cols; i++) {
+            for(int j = 0; j < num_of_rows-1; j++) {
+                if(grid[i][j] == nullptr) {
+                    int y = j+1;
+                    while (y < num_of_rows && grid[i][y] == nullptr) {
+                        y++;
+                    }
+                    if(y < num_of_rows) {
+                        swap(vec2(i,j), vec2(i,y));
+                        addMovement(vec2(i,j), grid_to_coords(vec2(i,y)), grid_to_coords(vec2(i,j)), -1, -1);
+                        set_cell_position(vec2(i,j), grid_to_coords(vec2(i,y)));
+                    }
+                }
+            }
+        }
+    }
+    
+    bool fillgrid() {
+        PROFILE_SCOPE(STAGE_FILLGRID);
+        bool empty_cells = false;
+        // the spawn policy sees the board as filled so far
+        Board& board = mirror;
+        for(int i = 0; i < num_of_cols; i++) {
+            int null_in_row = 0;
+            int lowest = -1;
+            for(int j = 0; j < num_of_rows; j++) {
+                if(grid[i][j] == nullptr) {
+                    empty_cells = true;
+                    if(lowest < 0) lowest = j;
+                    int gem_type = spawn_policy->spawn(board, i, j, lowest, rng);
+                    board.set(i, j, gem_type);
+                    grid.at(i).at(j) = addGameObject(gem_type);
+                    grid.at(i).at(j)->set_in_grid(true);
+                    addMovement(vec2(i,j), grid_to_coords(vec2(i,10+null_in_row)), grid_to_coords(vec2(i,j)), -1, -1);
+                    set_cell_position(vec2(i,j), grid_to_coords(vec2(i,10+null_in_row)));
+                    null_in_row++;
+                }
+            }
+        }
+        return empty_cells;
+    }
+    
+    void stop_motion(vec2 cell) {
+        grid[cell.x][cell.y]->stopMotion();
+    }
+    
+    void set_cell_position(vec2 cell, vec2 position) {
+        grid[cell.x][cell.y]->setPosition(position);
+    }
+    
+    
+    bool move_object(Movement* m, double t) {
+        if(grid[m->cell.x][m->cell.y] != nullptr) {
+            double ratio = (t-m->start_t)/(m->end_t-m->start_t);
+            set_cell_position(m->cell, vec2(m->start_loc.x + (m->end_loc.x-m->start_loc.x)*ratio, m->start_loc.y + (m->end_loc.y-m->start_loc.y)*ratio));
+            return true;
+        }
+        return false;
+    }
+};
+
+
+
+// GL_TIME_ELAPSED and GL_TIMESTAMP queries are core since 3.3, an extension before. needs a context
+bool timerQueriesSupported() {
+    GLint major = 0, minor = 0, extensions = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    bool supported = major*10 + minor >= 33;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+    for(int i = 0; i < extensions && !supported; i++) {
+        supported = !strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_timer_query");
+    }
+    return supported;
+}
+
+// GL_TIME_ELAPSED queries around the two draw passes. results are read a few frames later, once the
+// GPU has them, so timing never stalls the pipeline; a frame whose queries are still in flight from
+// frames_in_flight frames ago is not timed
+class PassTimer {
+    static const int frames_in_flight = 4;
+    static const int num_of_passes = 2;
+    GLuint queries[frames_in_flight][num_of_passes];
+    bool pending[frames_in_flight];
+    int frame;
+    bool supported;
+    bool timing;
+public:
+    PassTimer() {
+        frame = 0;
+        timing = false;
+        for(int f = 0; f < frames_in_flight; f++) pending[f] = false;
+        supported = timerQueriesSupported();
+        if(supported) {
+            glGenQueries(frames_in_flight*num_of_passes, &queries[0][0]);
+        }
+    }
+    
+    ~PassTimer() {
+        if(supported) {
+            glDeleteQueries(frames_in_flight*num_of_passes, &queries[0][0]);
+        }
+    }
+    
+    // call once per frame before the first pass
+    void beginFrame() {
+        collect();
+        timing = supported && profiling && !pending[frame];
+    }
+    
+    void begin(int pass) {
+        if(timing) {
+            glBeginQuery(GL_TIME_ELAPSED, queries[frame][pass]);
+        }
+    }
+    
+    void end() {
+        if(timing) {
+            glEndQuery(GL_TIME_ELAPSED);
+        }
+    }
+    
+    void endFrame() {
+        if(timing) {
+            pending[frame] = true;
+        }
+        frame = (frame + 1) % frames_in_flight;
+    }
+    
+    // hand every finished frame's pass times to the profiler
+    void collect() {
+        for(int f = 0; f < frames_in_flight; f++) {
+            if(!pending[f]) {
+                continue;
+            }
+            GLint available = 0;
+            glGetQueryObjectiv(queries[f][num_of_passes - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available) {
+                continue;
+            }
+            for(int pass = 0; pass < num_of_passes; pass++) {
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(queries[f][pass], GL_QUERY_RESULT, &nanoseconds);
+                profiler.addSeconds(STAGE_GPU_OPAQUE + pass, nanoseconds * 1e-9);
+            }
+            pending[f] = false;
+        }
+    }
+};
+
+
+// GL side of the scene: owns shaders, materials and meshes and draws frame snapshots
+class SceneRenderer {
+    std::vector<Shader*> shaders;
+    std::vector<Material*> materials;
+    std::vector<Geometry*> geometries;
+    std::vector<Mesh*> meshes;
+#if GEMSWAP_PROFILE
+    PassTimer pass_timer;
+#endif
+    
+public:
+    int gem_types;
+    
+    SceneRenderer() {
+        Initialize();
+    }
+    
+    void Initialize() {
+        
+        
+        shaders.push_back(new StandardShader());
+        shaders.push_back(new TexturedShader());
+        
+        materials.push_back(new Material(shaders[0], vec4(1, 0, 0), vec4(1, 0.078,0.576), 8));
+        materials.push_back(new Material(shaders[0], vec4(1, 1, 0)));
+        materials.push_back(new Material(shaders[0], vec4(0.5, 1, 0), vec4(0,1,0.5), 4));
+        materials.push_back(new Material(shaders[0], vec4(0.25, 0, 1), vec4(0,0.25,1), 5));
+        materials.push_back(new Material(shaders[0], vec4(0.5, 0.25, 1), vec4(0.5, 0, 1), 6));
+        materials.push_back(new Material(shaders[0], vec4(1, 0.5, 0)));
+        materials.push_back(new Material(shaders[1], vec4(), new Texture("asteroidtexturepack/asteroid3.png")));
+        materials.push_back(new Material(shaders[1], vec4(), new Texture("asteroidtexturepack/asteroid2.png")));
+
+        
+        geometries.push_back(new Heart());
+        geometries.push_back(new Star());
+        geometries.push_back(new Triangle());
+        geometries.push_back(new Quad());
+        geometries.push_back(new Pent());
+        geometries.push_back(new Diamond());
+        geometries.push_back(new TexturedQuad());
+        geometries.push_back(new TexturedQuad());
+        
+        
+        for (int i = 0; i < (int)materials.size() && i < (int)geometries.size(); i++) {
+            meshes.push_back(new Mesh(geometries[i], materials[i]));
+        }
+        gem_types = meshes.size();
+    }
+    ~SceneRenderer() {
+        for(int i = 0; i < (int)materials.size(); i++) delete materials[i];
+        for(int i = 0; i < (int)geometries.size(); i++) delete geometries[i];
+        for(int i = 0; i < (int)meshes.size(); i++) delete meshes[i];
+        for(int i = 0; i < (int)shaders.size(); i++) delete shaders[i];
+        
+    }
+    
+    // alpha: how far the renderer is between the previous tick and the snapshot's tick
+    void Draw(const FrameSnapshot& frame, double alpha)
+    {
+        PROFILE_SCOPE(STAGE_DRAW);
+#if GEMSWAP_PROFILE
+        pass_timer.beginFrame();
+#endif
+        // draw objects with overriden position on top
+        for(int pass = 0; pass < 2; pass++) {
+#if GEMSWAP_PROFILE
+            pass_timer.begin(pass);
+#endif
+            for(int i = 0; i < (int)frame.sprites.size(); i++) {
+                const GemSprite& s = frame.sprites[i];
+                if(s.draw_last != (pass == 1)) {
+                    continue;
+                }
+                vec2 position = vec2(s.prev_position.x + (s.position.x - s.prev_position.x)*alpha, s.prev_position.y + (s.position.y - s.prev_position.y)*alpha);
+                vec2 scaling = vec2(s.prev_scaling.x + (s.scaling.x - s.prev_scaling.x)*alpha, s.prev_scaling.y + (s.scaling.y - s.prev_scaling.y)*alpha);
+                Object object(meshes[s.gem_type], position, s.draw_last, scaling, s.orientation, s.rotation_rate);
+                object.Draw();
+            }
+#if GEMSWAP_PROFILE
+            pass_timer.end();
+#endif
+        }
+#if GEMSWAP_PROFILE
+        pass_timer.endFrame();
+#endif
+    }
+};
+
+
+
+Scene* gScene;
+SceneRenderer* gRenderer;
+
+// frames handed from the simulation thread to the render thread
+TripleBuffer<FrameSnapshot> frames;
+
+// input handed from the GLUT callbacks to the simulation thread, which is the only one touching gScene
+SpscQueue<InputEvent, 256> input_queue;
+
+std::atomic<bool> sim_running(false);
+std::thread* sim_thread = nullptr;
+
+
+// seconds on a monotonic clock shared by the simulation and render threads
+double wallTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one slice ('X') or counter sample ('C') of a trace, times in seconds on wallTime
+struct TraceEvent {
+    const char* name;       // string literal
+    char type;
+    double begin;
+    double duration;
+    long long value;
+};
+
+// Chrome trace-event JSON of the session, for chrome://tracing or ui.perfetto.dev. each thread buffers
+// its own events in memory and nothing is written until the end; past max_events, events are dropped
+class TraceRecorder {
+    struct ThreadTrace {
+        std::vector<TraceEvent> events;
+        const char* name;
+        int tid;
+    };
+    std::mutex mutex;
+    std::vector<ThreadTrace*> threads;
+    std::atomic<size_t> recorded;
+    std::atomic<unsigned int> dropped;
+    size_t max_events;
+    double origin;
+    
+    ThreadTrace& local() {
+        thread_local ThreadTrace* trace = nullptr;
+        if(trace == nullptr) {
+            trace = new ThreadTrace();
+            trace->name = "thread";
+            std::lock_guard<std::mutex> lock(mutex);
+            trace->tid = threads.size() + 1;
+            threads.push_back(trace);
+        }
+        return *trace;
+    }
+    
+    void add(const TraceEvent& event) {
+        AllocScope alloc_scope(ALLOC_TRACE);
+        if(recorded++ >= max_events) {
+            dropped++;
+            return;
+        }
+        local().events.push_back(event);
+    }
+    
+public:
+    bool enabled;
+    
+    TraceRecorder() : recorded(0), dropped(0), max_events(0), origin(0), enabled(false) {}
+    
+    ~TraceRecorder() {
+        for(int i = 0; i < (int)threads.size(); i++) delete threads[i];
+    }
+    
+    // call before the threads being traced start
+    void start(size_t _max_events) {
+        max_events = _max_events;
+        origin = wallTime();
+        enabled = true;
+    }
+    
+    // label the calling thread in the viewer
+    void nameThread(const char* name) {
+        if(enabled) {
+            local().name = name;
+        }
+    }
+    
+    void slice(const char* name, double begin, double end) {
+        if(enabled) {
+            TraceEvent event = {name, 'X', begin, end - begin, 0};
+            add(event);
+        }
+    }
+    
+    void counter(const char* name, long long value, double at) {
+        if(enabled) {
+            TraceEvent event = {name, 'C', at, 0, value};
+            add(event);
+        }
+    }
+    
+    // call once every traced thread has stopped
+    bool write(const char* path) {
+        FILE* file = fopen(path, "w");
+        if(file == NULL) {
+            return false;
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"GemSwap\"}}");
+        for(int t = 0; t < (int)threads.size(); t++) {
+            ThreadTrace* trace = threads[t];
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", trace->tid, trace->name);
+            for(int i = 0; i < (int)trace->events.size(); i++) {
+                const TraceEvent& e = trace->events[i];
+                double ts = (e.begin - origin) * 1e6;
+                if(e.type == 'X') {
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", e.name, trace->tid, ts, e.duration * 1e6);
+                }
+                else {
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}", e.name, trace->tid, ts, e.value);
+                }
+            }
+        }
+        fprintf(file, "\n]}\n");
+        bool written = !ferror(file);
+        fclose(file);
+        if(dropped > 0) {
+            printf("trace: %u events dropped past %zu\n", (unsigned int)dropped, max_events);
+        }
+        return written;
+    }
+};
+
+// --trace file: frame, phase and cascade timelines written at exit
+TraceRecorder trace;
+const char* trace_path = nullptr;
+
+// phase slices on the simulation thread; a cascade spans everything from leaving idle to coming back
+GamePhase traced_phase = PHASE_IDLE;
+double traced_phase_began = 0;
+double traced_cascade_began = 0;
+
+void tracePhase() {
+    if(!trace.enabled || gScene->phase == traced_phase) {
+        return;
+    }
+    double now = wallTime();
+    if(traced_phase != PHASE_IDLE) {
+        trace.slice(phase_names[traced_phase], traced_phase_began, now);
+    }
+    else {
+        traced_cascade_began = now;
+    }
+    if(gScene->phase == PHASE_IDLE) {
+        trace.slice("cascade", traced_cascade_began, now);
+    }
+    traced_phase = gScene->phase;
+    traced_phase_began = now;
+}
+
+// arrival of the oldest input that changed the board since the last published frame, 0 if none
+double unpublished_input_at = 0;
+// stamp of the last published frame. while the renderer has not taken that frame it is replaced
+// unseen by the next, which carries the stamp on so the input is timed to the frame that shows it
+double published_input_at = 0;
+
+void noteInputApplied(const InputEvent& event) {
+    if(unpublished_input_at == 0 || event.arrived_at < unpublished_input_at) {
+        unpublished_input_at = event.arrived_at;
+    }
+}
+
+void publishFrame() {
+    AllocScope alloc_scope(ALLOC_FRAME);
+    FrameSnapshot& frame = frames.backBuffer();
+    gScene->UpdateGrid(frame);
+    frame.published_at = wallTime();
+    frame.input_arrived_at = unpublished_input_at;
+    if(published_input_at != 0 && frames.unread()) {
+        // inputs are applied in arrival order, so the carried stamp is the older one
+        frame.input_arrived_at = published_input_at;
+    }
+    published_input_at = frame.input_arrived_at;
+    unpublished_input_at = 0;
+    frames.publish();
+    trace.counter("movements", gScene->movements.size(), frame.published_at);
+    trace.counter("removals", gScene->removals.size(), frame.published_at);
+}
+
+
+// 's' checkpoints the scene here, 'l' goes back to the checkpoint
+const char* snapshot_path = "gemswap.snapshot";
+
+void saveSnapshot(Scene* scene) {
+    std::vector<unsigned char> data;
+    scene->save(data);
+    FILE* file = fopen(snapshot_path, "wb");
+    if(file == NULL || fwrite(&data[0], 1, data.size(), file) != data.size()) {
+        printf("could not write %s\n", snapshot_path);
+    }
+    if(file != NULL) {
+        fclose(file);
+    }
+}
+
+bool loadSnapshot(Scene* scene) {
+    std::vector<unsigned char> data;
+    if(!readFile(snapshot_path, data)) {
+        return false;
+    }
+    if(data.empty() || !scene->restore(&data[0], data.size())) {
+        printf("%s is not a snapshot of this board\n", snapshot_path);
+        return false;
+    }
+    return true;
+}
+
+// apply one input event to the board, return true if the board changed
+bool applyInput(Scene* scene, const InputEvent& event) {
+    AllocScope alloc_scope(ALLOC_INPUT);
+    if(event.type == INPUT_KEY_DOWN || event.type == INPUT_KEY_UP) {
+        bool down = event.type == INPUT_KEY_DOWN;
+        if(event.key == 'b') {
+            scene->b_pressed = down;
+        }
+        if(event.key == 'q' && down) {
+            if(scene->acceptsInput()) {
+                scene->setPhase(PHASE_QUAKE);
+            }
+            if(scene->phase == PHASE_QUAKE) {
+                scene->processQuake();
+                return true;
+            }
+        }
+        if(event.key == 'q' && !down && scene->phase == PHASE_QUAKE) {
+            // knocked out gems still have to shrink, fall and be refilled
+            scene->setPhase(PHASE_CLEARING);
+            return true;
+        }
+        return false;
+    }
+    
+    if(!scene->acceptsInput()) {
+        return false;
+    }
+    vec2 mouse_click = event.position;
+    if(event.type == INPUT_MOTION) {
+        if(scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y] != nullptr) {
+            scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y]->warpPosition(mouse_click);
+            return true;
+        }
+        return false;
+    }
+    if(event.type == INPUT_MOUSE_DOWN) {
+        scene->selected_grid_cell = scene->coords_to_grid(mouse_click);
+        if(scene->b_pressed) {
+            GameObject* bombed = scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y];
+            if(bombed == nullptr) {
+                return false;
+            }
+            scene->emit(EVENT_BOMB, bombed->getType(), scene->selected_grid_cell, scene->selected_grid_cell, 0);
+            scene->remove_cell(scene->selected_grid_cell);
+            scene->empty_cell(scene->selected_grid_cell);
+            scene->setPhase(PHASE_CLEARING);
+            return true;
+        }
+        return false;
+    }
+    if(scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y] == nullptr) {
+        return false;
+    }
+    scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y]->setPosition(vec2(-10,-10));
+    vec2 to_swap_grid_cell = scene->coords_to_grid(mouse_click);
+    if(fabs(scene->selected_grid_cell.x - to_swap_grid_cell.x)+fabs(scene->selected_grid_cell.y - to_swap_grid_cell.y) == 1) {
+        bool legal = scene->isLegalMove(scene->selected_grid_cell, to_swap_grid_cell);
+        scene->emit(EVENT_SWAP, scene->grid[scene->selected_grid_cell.x][scene->selected_grid_cell.y]->getType(),
+                    scene->selected_grid_cell, to_swap_grid_cell, legal);
+        if(legal) {
+            scene->swap(scene->selected_grid_cell, to_swap_grid_cell);
+            scene->addMovement(to_swap_grid_cell, mouse_click, scene->grid_to_coords(to_swap_grid_cell), time_glob, time_glob+move_time);
+            scene->addMovement(scene->selected_grid_cell, scene->grid_to_coords(to_swap_grid_cell), scene->grid_to_coords(scene->selected_grid_cell), time_glob, time_glob+move_time);
+        }
+        else {
+            scene->addMovement(scene->selected_grid_cell, mouse_click, scene->grid_to_coords(to_swap_grid_cell), time_glob, time_glob+move_time);
+            scene->addMovement(to_swap_grid_cell, scene->grid_to_coords(to_swap_grid_cell), scene->grid_to_coords(scene->selected_grid_cell), time_glob, time_glob+move_time);
+            scene->addMovement(scene->selected_grid_cell, scene->grid_to_coords(to_swap_grid_cell), scene->grid_to_coords(scene->selected_grid_cell), time_glob+move_time, time_glob+2*move_time);
+            scene->addMovement(to_swap_grid_cell, scene->grid_to_coords(scene->selected_grid_cell), scene->grid_to_coords(to_swap_grid_cell), time_glob+move_time, time_glob+2*move_time);
+        }
+    }
+    else {
+        scene->addMovement(scene->selected_grid_cell, mouse_click, scene->grid_to_coords(scene->selected_grid_cell), time_glob, time_glob+move_time);
+    }
+    scene->setPhase(PHASE_SWAPPING);
+    return true;
+}
+
+// --record: every event applied to the board, written out at exit. --replay: the events to apply instead
+// of live input, each right before the tick it was recorded at
+InputRecording recording;
+const char* record_path = nullptr;
+RecordingView* replay = nullptr;
+
+// --events: analytics of the session, see EventLog
+EventLog event_log;
+
+bool applyAndTrace(const InputEvent& event) {
+    // checkpoints are a tool of the live session, they are neither recorded nor replayed. loading one
+    // rewinds the clock and replaces the board, which a recording could not reproduce, so both keys are
+    // off while recording
+    if(event.type == INPUT_KEY_DOWN && (event.key == 's' || event.key == 'l') && record_path != nullptr) {
+        printf("snapshots are disabled while recording\n");
+        return false;
+    }
+    if(event.type == INPUT_KEY_DOWN && event.key == 's') {
+        saveSnapshot(gScene);
+        return false;
+    }
+    if(event.type == INPUT_KEY_DOWN && event.key == 'l') {
+        if(loadSnapshot(gScene)) {
+            noteInputApplied(event);
+            return true;
         }
-        fillgrid();
+        return false;
     }
-    
-    bool fillgrid() {
-        bool empty_cells = false;
-        for(int i = 0; i < num_of_cols; i++) {
-            int null_in_row = 0;
-            for(int j = 0; j < num_of_rows; j++) {
-                if(grid[i][j] == nullptr) {
-                    empty_cells = true;
-                    addRandomGameObject();
-                    grid.at(i).at(j) = &gameObjects.back();
-                    grid.at(i).at(j)->set_in_grid(true);
-                    movements.push_back(new Movement(vec2(i,j), grid_to_coords(vec2(i,10+null_in_row)), grid_to_coords(vec2(i,j)), -1, -1));
-                    set_cell_position(vec2(i,j), grid_to_coords(vec2(i,10+null_in_row)));
-                    null_in_row++;
-                }
-            }
+    if(record_path != nullptr) {
+        recording.add(sim_tick, event);
+    }
+    if(applyInput(gScene, event)) {
+        noteInputApplied(event);
+        return true;
+    }
+    return false;
+}
+
+// drain the input queue once per tick; a run of motion events only applies its last position,
+// stamped with the arrival of the first one so latency counts from when the drag started
+bool processInput() {
+    bool board_changed = false;
+    if(replay != nullptr) {
+        InputEvent ignored;
+        while(input_queue.pop(ignored));
+        return false;
+    }
+    bool motion_pending = false;
+    InputEvent motion;
+    InputEvent event;
+    while(input_queue.pop(event)) {
+        if(event.type == INPUT_MOTION) {
+            double first_arrival = motion_pending ? motion.arrived_at : event.arrived_at;
+            motion = event;
+            motion.arrived_at = first_arrival;
+            motion_pending = true;
+            continue;
         }
-        return empty_cells;
+        if(motion_pending) {
+            board_changed = applyAndTrace(motion) || board_changed;
+            motion_pending = false;
+        }
+        board_changed = applyAndTrace(event) || board_changed;
     }
-    
-    void stop_motion(vec2 cell) {
-        grid[cell.x][cell.y]->stopMotion();
+    if(motion_pending) {
+        board_changed = applyAndTrace(motion) || board_changed;
     }
-    
-    void set_cell_position(vec2 cell, vec2 position) {
-        grid[cell.x][cell.y]->setPosition(position);
+    return board_changed;
+}
+
+// recorded events due at the current tick
+bool replayInput(Scene* scene, RecordingView& session) {
+    bool board_changed = false;
+    InputEvent event;
+    while(session.next(sim_tick, event)) {
+        board_changed = applyInput(scene, event) || board_changed;
     }
+    return board_changed;
+}
+
+// --alloc-check: once the opening board has settled, input and the rules must not allocate at all,
+// Scene's pools and reserved vectors cover play from then on. the one exception is the tick that
+// shuffles a deadlocked board, which builds the new layout in fresh storage. reports the ticks that
+// did allocate and what they allocated
+class AllocBudget {
+    AllocCounts last;
+    AllocCounts steady;
+    bool settled;
+    GamePhase last_phase;
+    unsigned int failed_ticks;
+public:
+    AllocBudget() : settled(false), last_phase(PHASE_REFILLING), failed_ticks(0) {}
     
+    // call after every tick of the scene being checked
+    void tick(Scene& scene) {
+        AllocCounts now = AllocCounts::now();
+        AllocCounts delta = now.since(last);
+        bool shuffled = scene.phase == PHASE_SHUFFLING && last_phase != PHASE_SHUFFLING;
+        last = now;
+        last_phase = scene.phase;
+        if(!settled) {
+            settled = scene.phase == PHASE_IDLE;
+            return;
+        }
+        if(delta.total() == 0 || shuffled) {
+            return;
+        }
+        if(failed_ticks < 8) {
+            printf("tick %lld:", sim_tick);
+            for(int t = 0; t < num_of_alloc_tags; t++) {
+                if(delta.count[t] > 0) {
+                    printf(" %s %llu allocs %llu bytes", alloc_tag_names[t], delta.count[t], delta.bytes[t]);
+                }
+            }
+            printf("\n");
+        }
+        failed_ticks++;
+        for(int t = 0; t < num_of_alloc_tags; t++) {
+            steady.count[t] += delta.count[t];
+            steady.bytes[t] += delta.bytes[t];
+        }
+    }
     
-    bool move_object(Movement* m, double t) {
-        if(grid[m->cell.x][m->cell.y] != nullptr) {
-            double ratio = (t-m->start_t)/(m->end_t-m->start_t);
-            set_cell_position(m->cell, vec2(m->start_loc.x + (m->end_loc.x-m->start_loc.x)*ratio, m->start_loc.y + (m->end_loc.y-m->start_loc.y)*ratio));
+    bool report() {
+        if(!GEMSWAP_TRACK_ALLOCS) {
+            printf("allocation tracking is compiled out\n");
+            return false;
+        }
+        if(failed_ticks == 0) {
+            printf("no allocations after the opening board settled\n");
             return true;
         }
+        char title[128];
+        snprintf(title, sizeof(title), "%u ticks allocated after the opening board settled:", failed_ticks);
+        steady.report(title, 0);
         return false;
     }
 };
 
+// play a whole session headless on the calling thread, as fast as it goes, and return the hash of the
+// board it ends on. uses the thread's own clock, so sessions can be played side by side
+unsigned long long playRecording(RecordingView& session, EventLog* events = nullptr, AllocBudget* budget = nullptr) {
+    // the scene starts its opening animation at the current time, so the clock is reset first
+    sim_tick = 0;
+    time_glob = 0;
+    Scene scene(session.gem_types, session.seed);
+    scene.events = events;
+    while(sim_tick < session.ticks) {
+        replayInput(&scene, session);
+        sim_tick++;
+        time_glob = sim_tick * sim_dt;
+        scene.Tick();
+        if(budget != nullptr) {
+            budget->tick(scene);
+        }
+    }
+    return scene.toBoard().hash();
+}
+
+// fixed-tick simulation loop, runs on sim_thread until sim_running is cleared
+void simulationLoop() {
+    trace.nameThread("simulation");
+    double next_tick = wallTime();
+    while(sim_running) {
+        double now = wallTime();
+        bool board_changed = processInput();
+        tracePhase();
+        int ticks = 0;
+        while(next_tick <= now && ticks < max_ticks_per_frame) {
+            if(replay != nullptr) {
+                board_changed = replayInput(gScene, *replay) || board_changed;
+            }
+            sim_tick++;
+            time_glob = sim_tick * sim_dt;
+            board_changed = gScene->Tick() || board_changed;
+            tracePhase();
+            next_tick += sim_dt;
+            ticks++;
+        }
+        // too far behind (e.g. machine suspended): drop the backlog rather than spiral
+        if(next_tick <= now) {
+            next_tick = now + sim_dt;
+        }
+        // an idle board has nothing to animate, so frames are only published while a phase is running
+        if(board_changed || !gScene->acceptsInput()) {
+            publishFrame();
+            trace.slice("step", now, wallTime());
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(next_tick - wallTime()));
+    }
+    // the clock is this thread's own
+    recording.ticks = sim_tick;
+}
+
 
 
-Scene* gScene;
+LatencyHistogram input_latency;
+
+// fences inserted after swaps that show new input, polled without blocking on later frames. where
+// timer queries exist a GL_TIMESTAMP query goes in with the fence and its GPU time, moved onto the
+// wall clock, is when the swap finished; without them it is the poll that finds the fence signaled,
+// which can be a frame late
+struct SwapFence {
+    GLsync fence;
+    GLuint timestamp;   // 0 without timer queries
+    double input_arrived_at;
+};
+std::vector<SwapFence> swap_fences;
+double traced_input_at = 0;
+
+void traceSwap(double input_arrived_at) {
+    static bool timestamps = timerQueriesSupported();
+    // fences pile up only if the GPU stops retiring frames, don't let tracing grow without bound
+    if(swap_fences.size() >= 16) {
+        return;
+    }
+    SwapFence swap_fence;
+    swap_fence.timestamp = 0;
+    if(timestamps) {
+        glGenQueries(1, &swap_fence.timestamp);
+        glQueryCounter(swap_fence.timestamp, GL_TIMESTAMP);
+    }
+    swap_fence.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    swap_fence.input_arrived_at = input_arrived_at;
+    swap_fences.push_back(swap_fence);
+}
+
+void pollSwapFences() {
+    // wall clock minus GPU clock, read once for every fence this poll retires
+    bool calibrated = false;
+    double gpu_to_wall = 0;
+    for(int i = 0; i < (int)swap_fences.size(); i++) {
+        GLenum status = glClientWaitSync(swap_fences[i].fence, 0, 0);
+        if(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            double shown_at = wallTime();
+            if(swap_fences[i].timestamp != 0) {
+                if(!calibrated) {
+                    GLint64 gpu_now = 0;
+                    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+                    gpu_to_wall = wallTime() - gpu_now * 1e-9;
+                    calibrated = true;
+                }
+                // the query was issued before the fence, so its result is in
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(swap_fences[i].timestamp, GL_QUERY_RESULT, &nanoseconds);
+                shown_at = std::min(shown_at, nanoseconds * 1e-9 + gpu_to_wall);
+                glDeleteQueries(1, &swap_fences[i].timestamp);
+            }
+            input_latency.add(shown_at - swap_fences[i].input_arrived_at);
+            glDeleteSync(swap_fences[i].fence);
+            swap_fences.erase(swap_fences.begin() + i);
+            i--;
+        }
+    }
+}
 
 
+// debug overlay: once a second the window title shows the last frame's render stats and the mean
+// time of each profiled stage that ran since
+double overlay_shown_at = 0;
+unsigned long long profile_shown_calls[num_of_stages];
+unsigned long long profile_shown_total[num_of_stages];
+
+void showOverlay() {
+    double now = wallTime();
+    if(now - overlay_shown_at < 1) {
+        return;
+    }
+    overlay_shown_at = now;
+    const RenderStats& r = last_frame_stats;
+    char title[768];
+    int length = snprintf(title, sizeof(title), "GemSwap | %u draws %u programs %u vaos %u textures %u uniforms %u blends",
+                          r.draw_calls, r.program_switches, r.vao_binds, r.texture_binds, r.uniform_uploads, r.blend_toggles);
+#if GEMSWAP_PROFILE
+    double unit = profiler.secondsPerUnit() * 1e6;
+    for(int s = 0; s < num_of_stages; s++) {
+        unsigned long long calls, total;
+        profiler.totals(s, calls, total);
+        if(calls > profile_shown_calls[s] && length < (int)sizeof(title)) {
+            double mean = (total - profile_shown_total[s]) * unit / (calls - profile_shown_calls[s]);
+            length += snprintf(title + length, sizeof(title) - length, " | %s %.1f us", stage_names[s], mean);
+        }
+        profile_shown_calls[s] = calls;
+        profile_shown_total[s] = total;
+    }
+#endif
+    glutSetWindowTitle(title);
+}
 
 
 // initialization, create an OpenGL context
 void onInitialization()
 {
     glViewport(0, 0, windowWidth, windowHeight);
-    gScene = new Scene();
+    trace.nameThread("render");
+    gRenderer = new SceneRenderer();
+    if(replay != nullptr) {
+        if(replay->gem_types > gRenderer->gem_types) {
+            printf("recording uses %d gem types, only %d can be drawn\n", replay->gem_types, gRenderer->gem_types);
+            exit(1);
+        }
+        gScene = new Scene(replay->gem_types, replay->seed);
+    }
+    else {
+        recording.seed = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)(wallTime() * 1e6);
+        recording.gem_types = gRenderer->gem_types;
+        gScene = new Scene(recording.gem_types, recording.seed);
+    }
+    if(event_log.isOpen()) {
+        gScene->events = &event_log;
+    }
+    publishFrame();
     
+    sim_running = true;
+    sim_thread = new std::thread(simulationLoop);
 }
 
 void onExit()
 {
+    if(sim_thread != nullptr) {
+        sim_running = false;
+        sim_thread->join();
+        delete sim_thread;
+        sim_thread = nullptr;
+    }
+    event_log.close();
+    if(trace_path != nullptr && !trace.write(trace_path)) {
+        printf("could not write %s\n", trace_path);
+    }
+    if(record_path != nullptr) {
+        if(!recording.save(record_path)) {
+            printf("could not write %s\n", record_path);
+        }
+    }
     delete gScene;
+    gScene = nullptr;
+    delete gRenderer;
+    gRenderer = nullptr;
+    input_latency.report("input to photon");
+    reportRenderStats();
+    if(GEMSWAP_TRACK_ALLOCS) {
+        AllocCounts::now().report("allocations", rendered_frames);
+    }
+    profiler.report();
     printf("exit");
 }
 
 // window has become invalid: redraw
 void onDisplay()
 {
+    AllocScope alloc_scope(ALLOC_RENDER);
+    double frame_began = wallTime();
     glClearColor(0, 0, 0, 0); // background color
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
     
-    gScene->Draw();
+    frames.update();
+    const FrameSnapshot& frame = frames.frontBuffer();
+    
+    // the snapshot is one tick ahead of its previous positions: interpolate over the tick after it arrived
+    double since_publish = wallTime() - frame.published_at;
+    double alpha = since_publish / sim_dt;
+    if(alpha > 1) { alpha = 1; }
+    if(alpha < 0) { alpha = 0; }
+    render_time_glob = frame.time - sim_dt + since_publish;
+    
+    if(frame.phase == PHASE_QUAKE) {
+        camera.SetOrientation(5*sin(render_time_glob*20));
+    }
+    else {
+        camera.SetOrientation(0);
+    }
+    
+    gRenderer->Draw(frame, alpha);
+    
+    {
+        PROFILE_SCOPE(STAGE_SWAP_BUFFERS);
+        glutSwapBuffers(); // exchange the two buffers
+    }
     
-    glutSwapBuffers(); // exchange the two buffers
+    // the first frame showing an input is on screen once the GPU is past the swap
+    if(frame.input_arrived_at != 0 && frame.input_arrived_at != traced_input_at) {
+        traced_input_at = frame.input_arrived_at;
+        traceSwap(frame.input_arrived_at);
+    }
+    pollSwapFences();
+    endRenderStats();
+    trace.counter("draw calls", last_frame_stats.draw_calls, frame_began);
+    trace.counter("program switches", last_frame_stats.program_switches, frame_began);
+    trace.counter("uniform uploads", last_frame_stats.uniform_uploads, frame_began);
+    trace.slice("frame", frame_began, wallTime());
+    showOverlay();
 }
 
-vec2 selected_grid_cell;
-bool b_pressed, q_pressed;
-
 
+void postInput(InputType type, int x, int y, unsigned char key) {
+    InputEvent event;
+    event.type = type;
+    // drags can leave the window, the board only knows [-1, 1]
+    vec2 position((x/(double)windowWidth - 0.5)*2, (y/(double)windowWidth - 0.5)*-2);
+    event.position = vec2(std::max(-1.0f, std::min(position.x, 1.0f)), std::max(-1.0f, std::min(position.y, 1.0f)));
+    event.key = key;
+    event.arrived_at = wallTime();
+    input_queue.push(event);
+}
 
-void onMouse(int button, int state, int x, int y) {
-    if(!q_pressed && gScene->removals.size() == 0 && gScene->movements.size() == 0) {
-        double x_norm = (x/(double)windowWidth - 0.5)*2;
-        double y_norm = (y/(double)windowWidth - 0.5)*-2;
-        vec2 mouse_click = vec2(x_norm, y_norm);
-        if(state == GLUT_DOWN) {
-            selected_grid_cell = gScene->coords_to_grid(mouse_click);
-            if(b_pressed) {
-                gScene->remove_cell(selected_grid_cell);
-                gScene->grid[selected_grid_cell.x][selected_grid_cell.y] = nullptr;
-            }
-        }
-        else if(gScene->grid[selected_grid_cell.x][selected_grid_cell.y] != nullptr) {
-            gScene->grid[selected_grid_cell.x][selected_grid_cell.y]->setPosition(vec2(-10,-10));
-            vec2 to_swap_grid_cell = gScene->coords_to_grid(mouse_click);
-            if(fabs(selected_grid_cell.x - to_swap_grid_cell.x)+fabs(selected_grid_cell.y - to_swap_grid_cell.y) == 1) {
-                if(gScene->isLegalMove(selected_grid_cell, to_swap_grid_cell)) {
-                    gScene->swap(selected_grid_cell, to_swap_grid_cell);
-                    gScene->movements.push_back(new Movement(to_swap_grid_cell, mouse_click, gScene->grid_to_coords(to_swap_grid_cell), time_glob, time_glob+move_time));
-                    gScene->movements.push_back(new Movement(selected_grid_cell, gScene->grid_to_coords(to_swap_grid_cell), gScene->grid_to_coords(selected_grid_cell), time_glob, time_glob+move_time));
-                }
-                else {
-                    gScene->movements.push_back(new Movement(selected_grid_cell, mouse_click, gScene->grid_to_coords(to_swap_grid_cell), time_glob, time_glob+move_time));
-                    gScene->movements.push_back(new Movement(to_swap_grid_cell, gScene->grid_to_coords(to_swap_grid_cell), gScene->grid_to_coords(selected_grid_cell), time_glob, time_glob+move_time));
-                    gScene->movements.push_back(new Movement(selected_grid_cell, gScene->grid_to_coords(to_swap_grid_cell), gScene->grid_to_coords(selected_grid_cell), time_glob+move_time, time_glob+2*move_time));
-                    gScene->movements.push_back(new Movement(to_swap_grid_cell, gScene->grid_to_coords(selected_grid_cell), gScene->grid_to_coords(to_swap_grid_cell), time_glob+move_time, time_glob+2*move_time));
-                }
-            }
-            else {
-                gScene->movements.push_back(new Movement(selected_grid_cell, mouse_click, gScene->grid_to_coords(selected_grid_cell), time_glob, time_glob+move_time));
-            }
-            gScene->UpdateGrid();
-        }
-        
-        glutPostRedisplay();
-    }
+void onMouse(int /*button*/, int state, int x, int y) {
+    postInput(state == GLUT_DOWN ? INPUT_MOUSE_DOWN : INPUT_MOUSE_UP, x, y, 0);
 }
 
 void onMotion(int x, int y) {
-    if(!q_pressed && gScene->removals.size() == 0 && gScene->movements.size() == 0) {
-        double x_norm = (x/(double)windowWidth - 0.5)*2;
-        double y_norm = (y/(double)windowWidth - 0.5)*-2;
-        if(gScene->grid[selected_grid_cell.x][selected_grid_cell.y] != nullptr) {
-            gScene->set_cell_position(selected_grid_cell,vec2(x_norm, y_norm));
-            gScene->UpdateGrid();
-        }
-        glutPostRedisplay();
-    }
+    postInput(INPUT_MOTION, x, y, 0);
 }
 
 
 void onIdle() {
-    
-    time_glob = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-    
-    int removal_ouptput = gScene->processRemovals();
-    int movement_ouput = 0;
-    if(removal_ouptput == 0) {
-        gScene->skyfall();
-    }
-    else if(removal_ouptput == -1) {
-        gScene->processMovements();
-    }
-    if(movement_ouput != -1 || removal_ouptput != -1) {
-        gScene->UpdateGrid();
-    }
-    // show result
+    // the simulation runs on its own thread, keep presenting its newest frame
     glutPostRedisplay();
     
 }
 
 
 void onKeyboard(unsigned char key, int x, int y) {
-    if(key == 'b') {
-        b_pressed = true;
-    }
-    if(key == 'q') {
-        q_pressed = true;
-        camera.SetOrientation(5*sin(time_glob*20));
-        gScene->processQuake();
-
-    }
+    postInput(INPUT_KEY_DOWN, x, y, key);
 }
 
 void onKeyboardUp(unsigned char key, int x, int y) {
-    if(key == 'b') {
-        b_pressed = false;
-    }
-    if(key == 'q') {
-        q_pressed = false;
-        camera.SetOrientation(0);
-    }
+    postInput(INPUT_KEY_UP, x, y, key);
 }
 
 void reshape(int width, int height) {  // GLsizei for non-negative integer
@@ -1399,14 +5787,769 @@ void reshape(int width, int height) {  // GLsizei for non-negative integer
     glLoadIdentity();             // Reset
     gluOrtho2D(0.0, (GLdouble) width, 0.0, (GLdouble) height);
     
-    gScene->UpdateGrid();
     glutPostRedisplay();
 }
 
 
+// options shared by the headless modes; count is the number given after the mode's own flag
+struct HeadlessOptions {
+    int count;
+    unsigned long long seed;
+    int max_moves;
+    int gem_types;
+    int cols, rows;
+    const char* policy;
+    const char* spawn;
+    int depth;
+    
+    HeadlessOptions(int _count) {
+        count = _count;
+        seed = 1;
+        max_moves = 100;
+        gem_types = 8;
+        cols = 10;
+        rows = 10;
+        policy = "greedy";
+        spawn = "uniform";
+        depth = 3;
+    }
+};
+
+bool parseHeadless(int argc, char * argv[], const char* mode, HeadlessOptions& options) {
+    for(int a = 1; a < argc; a++) {
+        if(!strcmp(argv[a], mode) && a + 1 < argc) options.count = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--seed") && a + 1 < argc) options.seed = strtoull(argv[++a], NULL, 10);
+        else if(!strcmp(argv[a], "--moves") && a + 1 < argc) options.max_moves = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--gems") && a + 1 < argc) options.gem_types = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--policy") && a + 1 < argc) options.policy = argv[++a];
+        else if(!strcmp(argv[a], "--spawn") && a + 1 < argc) options.spawn = argv[++a];
+        else if(!strcmp(argv[a], "--depth") && a + 1 < argc) options.depth = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--size") && a + 2 < argc) {
+            options.cols = atoi(argv[++a]);
+            options.rows = atoi(argv[++a]);
+        }
+        else {
+            printf("unknown argument %s\n", argv[a]);
+            return false;
+        }
+    }
+    return options.count > 0 && options.cols >= 3 && options.rows >= 3 && options.gem_types >= 3 &&
+           options.gem_types <= Board::max_gem_types;
+}
+
+// GemSwap --simulate games [--policy random|greedy|solver|rollout]
+//                          [--spawn uniform|anti-cascade|anti-deadlock|weighted:w0,w1,...|scripted:file]
+//                          [--depth d] [--seed s] [--moves m] [--gems g] [--size cols rows]
+// plays the games headless on every core and prints throughput and balance statistics. depth is the
+// lookahead in plies of the solver and rollout policies, spawn picks the refills, see makeSpawnPolicy
+int simulateMain(int argc, char * argv[]) {
+    HeadlessOptions options(1000);
+    options.depth = 2;
+    Policy policy = POLICY_GREEDY;
+    bool parsed = parseHeadless(argc, argv, "--simulate", options) && options.depth >= 1;
+    if(parsed && !strcmp(options.policy, "random")) policy = POLICY_RANDOM;
+    else if(parsed && !strcmp(options.policy, "greedy")) policy = POLICY_GREEDY;
+    else if(parsed && !strcmp(options.policy, "solver")) policy = POLICY_SOLVER;
+    else if(parsed && !strcmp(options.policy, "rollout")) policy = POLICY_ROLLOUT;
+    else parsed = false;
+    int games = options.count;
+    int cols = options.cols, rows = options.rows, gem_types = options.gem_types;
+    const char* policy_name = options.policy;
+    
+    WorkerPool pool;
+    GameSimulator simulator(&pool, cols, rows, gem_types);
+    if(!parsed || !simulator.setSpawnPolicy(options.spawn)) {
+        printf("usage: %s --simulate games [--policy random|greedy|solver|rollout]\n"
+               "       [--spawn uniform|anti-cascade|anti-deadlock|weighted:w0,w1,...|scripted:file]\n"
+               "       [--depth d >= 1] [--seed s] [--moves m] [--gems g] [--size cols rows]\n", argv[0]);
+        return 1;
+    }
+    simulator.max_moves = options.max_moves;
+    simulator.search_depth = options.depth;
+    simulator.policy = policy;
+    std::vector<GameResult> results;
+    double start = wallTime();
+    simulator.run(games, options.seed, results);
+    double elapsed = wallTime() - start;
+    
+    long long moves = 0, chains = 0;
+    int deadlocks = 0;
+    double total_score = 0;
+    std::vector<long long> scores(games);
+    for(int g = 0; g < games; g++) {
+        moves += results[g].moves;
+        chains += results[g].chain_total;
+        deadlocks += results[g].deadlocked;
+        total_score += results[g].score;
+        scores[g] = results[g].score;
+    }
+    std::sort(scores.begin(), scores.end());
+    
+    printf("%d games, %dx%d board, %d gem types, %s policy, %s spawns, %d threads\n", games, cols, rows, gem_types, policy_name,
+           options.spawn, pool.size());
+    printf("games/s  %.1f\n", games / elapsed);
+    printf("moves/s  %.1f\n", moves / elapsed);
+    printf("moves per game  %.2f\n", (double)moves / games);
+    printf("cascade depth   %.3f\n", moves ? (double)chains / moves : 0.0);
+    printf("score  mean %.1f  min %lld  p10 %lld  p50 %lld  p90 %lld  max %lld\n", total_score / games,
+           scores[0], scores[games/10], scores[games/2], scores[games*9/10], scores[games - 1]);
+    printf("deadlocked  %.2f%%\n", 100.0 * deadlocks / games);
+    if(policy == POLICY_SOLVER) {
+        // every hit is a subtree of positions that did not have to be played out again
+        long long nodes, probes, hits;
+        simulator.searchCounts(nodes, probes, hits);
+        printf("table  probes %lld  hits %lld (%.1f%%)  positions played %lld\n", probes, hits,
+               probes ? 100.0 * hits / probes : 0.0, nodes);
+    }
+    if(policy == POLICY_ROLLOUT) {
+        printf("rollouts/s  %.0f  (%d plies, %.0f per thread)\n", simulator.rollouts() / elapsed, options.depth,
+               simulator.rollouts() / elapsed / pool.size());
+    }
+    return 0;
+}
+
+// GemSwap --generate boards [--seed s] [--gems g] [--size cols rows]
+// throughput of the opening board generator on every core
+int generateMain(int argc, char * argv[]) {
+    HeadlessOptions options(1000000);
+    if(!parseHeadless(argc, argv, "--generate", options)) {
+        printf("usage: %s --generate boards [--seed s] [--gems g] [--size cols rows]\n", argv[0]);
+        return 1;
+    }
+    const int chunk = 1024;
+    int chunks = (options.count + chunk - 1) / chunk;
+    WorkerPool pool;
+    std::vector<Board> boards(pool.size(), Board(options.cols, options.rows, options.gem_types));
+    std::vector<long long> attempts(chunks);
+    std::vector<int> failures(chunks);
+    std::vector<unsigned long long> digest(chunks);
+    
+    double start = wallTime();
+    pool.parallelFor(chunks, [&](int c, int worker) {
+        GemRng rng(options.seed ^ ((unsigned long long)c * 0xD1B54A32D192ED03ULL));
+        int n = std::min(chunk, options.count - c*chunk);
+        attempts[c] = 0;
+        failures[c] = 0;
+        digest[c] = 0;
+        for(int b = 0; b < n; b++) {
+            int drawn = boards[worker].generate(rng);
+            if(drawn == 0) {
+                failures[c]++;
+                drawn = Board::max_draws;
+            }
+            attempts[c] += drawn;
+            digest[c] ^= boards[worker].hash();
+        }
+    });
+    double elapsed = wallTime() - start;
+    
+    long long total_attempts = 0;
+    int total_failures = 0;
+    unsigned long long total_digest = 0;
+    for(int c = 0; c < chunks; c++) {
+        total_attempts += attempts[c];
+        total_failures += failures[c];
+        total_digest ^= digest[c];
+    }
+    printf("%d boards, %dx%d board, %d gem types, %d threads\n", options.count, options.cols, options.rows, options.gem_types, pool.size());
+    printf("boards/s  %.0f\n", options.count / elapsed);
+    printf("ns/cell   %.2f\n", elapsed * 1e9 / ((double)options.count * options.cols * options.rows));
+    printf("draws per board  %.4f\n", (double)total_attempts / options.count);
+    printf("no legal swap after %d draws  %d\n", (int)Board::max_draws, total_failures);
+    printf("digest  %016llx\n", total_digest);
+    return 0;
+}
+
+// GemSwap --perft boards [--depth d] [--seed s] [--gems g] [--size cols rows]
+// walks every line of play to depth d from generated boards and prints positions per ply and nodes/s
+int perftMain(int argc, char * argv[]) {
+    HeadlessOptions options(16);
+    if(!parseHeadless(argc, argv, "--perft", options) || options.depth < 1 || options.depth > 15) {
+        printf("usage: %s --perft boards [--depth 1-15] [--seed s] [--gems g] [--size cols rows]\n", argv[0]);
+        return 1;
+    }
+    // the roots travel to the workers as snapshots, a few bytes a board
+    Board board(options.cols, options.rows, options.gem_types);
+    size_t snapshot_size = board.snapshotSize();
+    std::vector<unsigned char> roots(options.count * snapshot_size);
+    for(int b = 0; b < options.count; b++) {
+        GemRng rng(options.seed ^ ((unsigned long long)b * 0xD1B54A32D192ED03ULL));
+        if(board.generate(rng) == 0) {
+            printf("no %dx%d board with %d gem types has a legal swap in %d draws\n", options.cols, options.rows,
+                   options.gem_types, (int)Board::max_draws);
+            return 1;
+        }
+        board.spawn_seed = rng.next();
+        board.save(&roots[b*snapshot_size]);
+    }
+    
+    WorkerPool pool;
+    Perft perft(&pool, options.depth);
+    std::vector<PerftCount> counts;
+    double start = wallTime();
+    bool loaded = perft.run(roots, snapshot_size, counts);
+    double elapsed = wallTime() - start;
+    if(!loaded) {
+        printf("a root snapshot did not load\n");
+        return 1;
+    }
+    
+    PerftCount total;
+    for(int b = 0; b < (int)counts.size(); b++) {
+        for(int d = 1; d <= options.depth; d++) {
+            total.nodes[d] += counts[b].nodes[d];
+        }
+        total.cleared += counts[b].cleared;
+        total.digest ^= counts[b].digest;
+    }
+    long long nodes = 0;
+    printf("%d boards, %dx%d board, %d gem types, depth %d, %d threads\n", options.count, options.cols, options.rows,
+           options.gem_types, options.depth, pool.size());
+    for(int d = 1; d <= options.depth; d++) {
+        printf("ply %d  %lld\n", d, total.nodes[d]);
+        nodes += total.nodes[d];
+    }
+    printf("nodes    %lld\n", nodes);
+    printf("cleared  %lld\n", total.cleared);
+    printf("digest   %016llx\n", total.digest);
+    printf("nodes/s  %.0f\n", nodes / elapsed);
+    return 0;
+}
+
+// GemSwap --replay file [--realtime] [--events file] [--profile] [--alloc-check]
+// without --realtime the recorded session is played headless as fast as it goes, as a reproducible
+// workload; the final board hash must match between runs and builds
+int replayMain(const char* path, EventLog* events, bool alloc_check) {
+    std::vector<unsigned char> data;
+    RecordingView session;
+    if(!readFile(path, data) || !session.open(data.empty() ? nullptr : &data[0], data.size())) {
+        printf("could not read recording %s\n", path);
+        return 1;
+    }
+    AllocBudget budget;
+    double start = wallTime();
+    unsigned long long hash = playRecording(session, events, alloc_check ? &budget : nullptr);
+    double elapsed = wallTime() - start;
+    printf("%lld ticks (%.1f s of play), %u inputs\n", session.ticks, session.ticks * sim_dt, session.inputs());
+    printf("ticks/s  %.0f\n", session.ticks / elapsed);
+    printf("us/tick  %.3f\n", elapsed * 1e6 / session.ticks);
+    printf("final board hash  %016llx\n", hash);
+    profiler.report();
+    if(alloc_check && !budget.report()) {
+        return 1;
+    }
+    return 0;
+}
+
+// replays the refill stream of one BoardBatch board for Board::refill. the batch draws a gem for every
+// cell of the board, in cell order, on every refill and keeps the ones that land on empty cells; Board
+// asks only for the empty cells, so the skipped draws are made here. a refill is over once as many gems
+// were spawned as the board had holes when it started
+class LaneSpawn : public SpawnPolicy {
+    unsigned int state;
+    int next_cell;      // the cell the next draw of the current refill is for
+    int holes;          // gems still to spawn in the current refill
+    bool started;
+    
+    int draw(int gem_types) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (int)(((state >> 16) * (unsigned int)gem_types) >> 16);
+    }
+    
+public:
+    LaneSpawn(unsigned int stream) : state(stream), next_cell(0), holes(0), started(false) {}
+    
+    int spawn(const Board& board, int i, int j, int /*from*/, GemRng& /*rng*/) {
+        int cells = board.num_of_cols * board.num_of_rows;
+        if(holes == 0) {
+            // a new refill: finish the draws of the last one
+            for(; started && next_cell < cells; next_cell++) draw(board.gem_types);
+            next_cell = 0;
+            started = true;
+            for(int k = 0; k < cells; k++) holes += board.at(k / board.num_of_rows, k % board.num_of_rows) == Board::EMPTY;
+        }
+        int cell = i*board.num_of_rows + j;
+        for(; next_cell < cell; next_cell++) draw(board.gem_types);
+        next_cell++;
+        holes--;
+        return draw(board.gem_types);
+    }
+};
+
+// GemSwap --check boards [--seed s] [--moves m] [--gems g] [--size cols rows]
+// self-check of the batched rules against the scalar ones: every board of a BoardBatch is copied into a
+// Board, both play the same swap, one legal swap or a swap that makes no run when there is none, with the
+// batch's refill stream, and must end with the same cells and the same gems cleared, at rest. then runs
+// GemEnv with random actions and checks its observations, rewards and dones, and round-trips played
+// boards through Board snapshots. exits 1 on any mismatch
+int checkMain(int argc, char * argv[]) {
+    HeadlessOptions options(256);
+    if(!parseHeadless(argc, argv, "--check", options)) {
+        printf("usage: %s --check boards [--seed s] [--moves m] [--gems g] [--size cols rows]\n", argv[0]);
+        return 1;
+    }
+    int cols = options.cols, rows = options.rows;
+    BoardBatch batch(options.count, cols, rows, options.gem_types);
+    batch.reset(options.seed);
+    std::vector<Move> moves(batch.num_of_boards);
+    std::vector<int> cleared(batch.num_of_boards);
+    std::vector<unsigned int> streams(batch.num_of_boards);
+    std::vector<unsigned char> legal(batch.num_of_boards);
+    std::vector<Board> boards(batch.num_of_boards, Board(cols, rows, options.gem_types));
+    std::vector<Move> legal_moves;
+    GemRng rng(options.seed);
+    long long steps = 0, mismatches = 0, undone = 0;
+    for(int move = 0; move < options.max_moves; move++) {
+        for(int b = 0; b < batch.num_of_boards; b++) {
+            Board& board = boards[b];
+            for(int i = 0; i < cols; i++) {
+                for(int j = 0; j < rows; j++) board.set(i, j, batch.at(b, i, j));
+            }
+            board.markClean();
+            board.legalMoves(legal_moves);
+            moves[b] = legal_moves.empty() ? Move(0, 0, 1, 0) : legal_moves[rng.below((int)legal_moves.size())];
+            streams[b] = batch.stream(b);
+        }
+        batch.step(&moves[0], &cleared[0]);
+        batch.hasLegalMove(&legal[0]);
+        for(int b = 0; b < batch.num_of_boards; b++) {
+            Board& board = boards[b];
+            bool made_run = board.isLegalMove(moves[b]);
+            int expected = 0;
+            if(made_run) {
+                LaneSpawn policy(streams[b]);
+                expected = board.play(moves[b], rng, policy).cleared;
+            }
+            else {
+                undone++;
+            }
+            // same cells, full and without a run of three left
+            bool same = cleared[b] == expected && (legal[b] != 0) == board.hasLegalMove();
+            for(int i = 0; i < cols; i++) {
+                for(int j = 0; j < rows; j++) {
+                    int gem_type = board.at(i, j);
+                    same = same && gem_type != Board::EMPTY && batch.at(b, i, j) == gem_type;
+                    same = same && !(i + 2 < cols && board.at(i + 1, j) == gem_type && board.at(i + 2, j) == gem_type);
+                    same = same && !(j + 2 < rows && board.at(i, j + 1) == gem_type && board.at(i, j + 2) == gem_type);
+                }
+            }
+            if(!same && mismatches++ < 10) {
+                printf("board %d, move %d: (%d, %d)-(%d, %d) differs, cleared %d, expected %d\n", b, move,
+                       moves[b].i1, moves[b].j1, moves[b].i2, moves[b].j2, cleared[b], expected);
+            }
+            steps++;
+        }
+    }
+    printf("BoardBatch  %lld steps on %d boards, %lld without a run, %lld mismatches\n",
+           steps, batch.num_of_boards, undone, mismatches);
+    
+    // GemEnv: every cell hot in exactly one plane, rewards the gems cleared, done at the step limit
+    GemEnv env(options.count, cols, rows, options.gem_types, 50);
+    int plane = cols * rows;
+    std::vector<unsigned char> observations((size_t)env.num_of_envs * env.observationSize());
+    std::vector<int> actions(env.num_of_envs);
+    std::vector<float> rewards(env.num_of_envs);
+    std::vector<unsigned char> dones(env.num_of_envs);
+    std::vector<int> episode_steps(env.num_of_envs, 0);
+    long long env_errors = 0, episodes = 0;
+    env.reset(options.seed, &observations[0]);
+    for(int t = 0; t <= options.max_moves; t++) {
+        for(int e = 0; e < env.num_of_envs; e++) {
+            const unsigned char* out = &observations[(size_t)e * env.observationSize()];
+            for(int k = 0; k < plane; k++) {
+                int hot = 0;
+                for(int g = 0; g < env.gem_types; g++) hot += out[g*plane + k];
+                if(hot != 1 && env_errors++ < 10) {
+                    printf("env %d, step %d: cell %d is hot in %d planes\n", e, t, k, hot);
+                }
+            }
+        }
+        if(t == options.max_moves) {
+            break;
+        }
+        for(int e = 0; e < env.num_of_envs; e++) actions[e] = rng.below(env.numActions());
+        env.step(&actions[0], &rewards[0], &dones[0], &observations[0]);
+        for(int e = 0; e < env.num_of_envs; e++) {
+            episode_steps[e]++;
+            bool reward_ok = rewards[e] == env.illegal_reward || (rewards[e] >= 3 && rewards[e] == (int)rewards[e]);
+            bool done_ok = episode_steps[e] < env.max_steps ? true : dones[e] != 0;
+            if((!reward_ok || !done_ok) && env_errors++ < 10) {
+                printf("env %d, step %d: reward %g, done %d after %d steps\n", e, t, rewards[e], dones[e], episode_steps[e]);
+            }
+            if(dones[e]) {
+                episode_steps[e] = 0;
+                episodes++;
+            }
+        }
+    }
+    printf("GemEnv      %lld env steps, %lld episodes, %lld errors\n",
+           (long long)options.max_moves * env.num_of_envs, episodes, env_errors);
+    
+    // Board snapshots: a played board comes back with the same cells, hash and spawn streams, and
+    // snapshots with a gem type out of range or a hash that does not fit are refused without harm
+    Board played(cols, rows, options.gem_types), loaded;
+    std::vector<unsigned char> snapshot(played.snapshotSize());
+    long long snapshot_errors = 0;
+    for(int b = 0; b < options.count; b++) {
+        GemRng board_rng(options.seed ^ ((unsigned long long)b * 0xD1B54A32D192ED03ULL));
+        if(played.generate(board_rng) == 0) {
+            continue;
+        }
+        played.spawn_seed = board_rng.next();
+        for(int m = 0; m < 8; m++) {
+            played.legalMoves(legal_moves);
+            if(legal_moves.empty()) break;
+            played.playFromStreams(legal_moves[board_rng.below((int)legal_moves.size())]);
+        }
+        played.save(&snapshot[0]);
+        bool same = loaded.load(&snapshot[0], snapshot.size()) && loaded.hash() == played.hash() &&
+                    loaded.spawn_seed == played.spawn_seed && loaded.gem_types == played.gem_types;
+        for(int i = 0; same && i < cols; i++) {
+            for(int j = 0; j < rows; j++) same = same && loaded.at(i, j) == played.at(i, j);
+        }
+        unsigned char& first_cells = snapshot[22 + 4*cols];
+        unsigned char cells_byte = first_cells;
+        if(options.gem_types < Board::max_gem_types) {
+            first_cells = (cells_byte & 0xF0) | options.gem_types;
+            same = same && !loaded.load(&snapshot[0], snapshot.size());
+            first_cells = cells_byte;
+        }
+        snapshot[14] ^= 1;
+        same = same && !loaded.load(&snapshot[0], snapshot.size()) && loaded.hash() == played.hash();
+        if(!same && snapshot_errors++ < 10) {
+            printf("board %d: snapshot round trip failed\n", b);
+        }
+    }
+    printf("Board       %d snapshots, %lld errors\n", options.count, snapshot_errors);
+    return mismatches == 0 && env_errors == 0 && snapshot_errors == 0 ? 0 : 1;
+}
+
+// GemSwap --corpus-add corpus recording...    appends recordings made with --record
+// GemSwap --corpus-bench corpus [--profile]   replays every game headless on every core
+int corpusMain(int argc, char * argv[]) {
+    if(argc >= 4 && !strcmp(argv[1], "--corpus-add")) {
+        for(int a = 3; a < argc; a++) {
+            std::vector<unsigned char> data;
+            RecordingView check;
+            if(!readFile(argv[a], data) || data.empty() || !check.open(&data[0], data.size())) {
+                printf("%s is not a recording\n", argv[a]);
+                return 1;
+            }
+            data.resize(check.size());
+            if(!ReplayCorpus::append(argv[2], data)) {
+                printf("could not append to %s\n", argv[2]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    ReplayCorpus corpus;
+    bool options = argc == 3 || (argc == 4 && !strcmp(argv[3], "--profile"));
+    if(!options || strcmp(argv[1], "--corpus-bench") || !corpus.open(argv[2])) {
+        printf("usage: %s --corpus-add corpus recording... | --corpus-bench corpus [--profile]\n", argv[0]);
+        return 1;
+    }
+    WorkerPool pool;
+    int games = corpus.size();
+    std::vector<unsigned long long> hashes(games);
+    std::vector<long long> ticks(games);
+    std::vector<unsigned int> inputs(games);
+    std::atomic<int> broken(0);
+    double start = wallTime();
+    pool.parallelFor(games, [&](int g, int /*worker*/) {
+        RecordingView session;
+        if(!corpus.game(g, session)) {
+            broken++;
+            return;
+        }
+        ticks[g] = session.ticks;
+        inputs[g] = session.inputs();
+        hashes[g] = playRecording(session);
+    });
+    double elapsed = wallTime() - start;
+    
+    long long total_ticks = 0, total_inputs = 0;
+    unsigned long long digest = 0;
+    for(int g = 0; g < games; g++) {
+        total_ticks += ticks[g];
+        total_inputs += inputs[g];
+        digest ^= hashes[g] * (2*g + 1);
+    }
+    printf("%d games, %lld ticks (%.1f h of play), %lld inputs, %d threads\n", games, total_ticks,
+           total_ticks * sim_dt / 3600, total_inputs, pool.size());
+    if(broken > 0) {
+        printf("%d games could not be read\n", (int)broken);
+    }
+    printf("games/s  %.1f\n", games / elapsed);
+    printf("ticks/s  %.0f\n", total_ticks / elapsed);
+    printf("digest   %016llx\n", digest);
+    profiler.report();
+    return broken > 0;
+}
+
+// one rules routine timed on copies of a prepared board. each batch of copies is made untimed and
+// then the routine runs once on each; batches repeat until min_time seconds of routine have been timed
+class RulesBench {
+    double min_time;
+    volatile unsigned long long sink;     // results folded in so no run can be optimized away
+public:
+    RulesBench(double _min_time) : min_time(_min_time), sink(0) {}
+    
+    // mean ns per call of op(board), which returns anything that depends on its work
+    template <typename Op>
+    double measure(const Board& prepared, Op op, long long& iterations) {
+        int cells = prepared.num_of_cols*prepared.num_of_rows;
+        int batch = std::max(1, std::min(1024, (1 << 16) / cells));
+        std::vector<Board> boards(batch, prepared);
+        double timed = 0;
+        iterations = 0;
+        while(timed < min_time) {
+            for(int b = 0; b < batch; b++) boards[b] = prepared;
+            double start = wallTime();
+            for(int b = 0; b < batch; b++) sink += op(boards[b]);
+            timed += wallTime() - start;
+            iterations += batch;
+        }
+        return timed * 1e9 / iterations;
+    }
+};
+
+// GemSwap --bench [--min-time s] [--filter text] [--size n] [--gems g]
+// times each rules routine over board sizes 8x8 to 512x512 and 3 to 8 gem types, or the one n x n
+// size and gem count given, and writes JSON to stdout, one entry per routine, size and gem count,
+// with ns per call and per cell. the routines are the Board versions of the Scene ones they are named
+// after, since Scene's grid is fixed at 10x10. isLegalMove is timed over every adjacent swap of the
+// board, cascade is one legal swap played until the board is at rest. batchStep and envStep are per board
+// of a BoardBatch and per environment of a GemEnv, each stepped with a random adjacent swap as an
+// exploring policy would play
+int benchMain(int argc, char * argv[]) {
+    double min_time = 0.1;
+    const char* filter = "";
+    std::vector<int> sizes;
+    std::vector<int> gem_counts;
+    for(int n = 8; n <= 512; n *= 2) sizes.push_back(n);
+    for(int g = 3; g <= 8; g++) gem_counts.push_back(g);
+    for(int a = 1; a < argc; a++) {
+        if(!strcmp(argv[a], "--bench")) continue;
+        else if(!strcmp(argv[a], "--min-time") && a + 1 < argc) min_time = atof(argv[++a]);
+        else if(!strcmp(argv[a], "--filter") && a + 1 < argc) filter = argv[++a];
+        else if(!strcmp(argv[a], "--size") && a + 1 < argc) sizes.assign(1, atoi(argv[++a]));
+        else if(!strcmp(argv[a], "--gems") && a + 1 < argc) gem_counts.assign(1, atoi(argv[++a]));
+        else {
+            printf("unknown argument %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if(sizes[0] < 3 || gem_counts[0] < 3 || gem_counts[0] > Board::max_gem_types) {
+        printf("usage: %s --bench [--min-time s] [--filter text] [--size n >= 3] [--gems 3-%d]\n", argv[0],
+               (int)Board::max_gem_types);
+        return 1;
+    }
+    
+    const char* names[] = {"isLegalMove", "removeLines", "skyfall", "fillgrid", "processQuake", "cascade",
+                           "batchStep", "envStep"};
+    const char* routines[] = {"Board::isLegalMove", "Board::clearMatches", "Board::collapse", "Board::refill",
+                              "Board::quake", "Board::play", "BoardBatch::step", "GemEnv::step"};
+    RulesBench bench(min_time);
+    printf("{\n  \"context\": {\"min_time\": %g, \"threads\": 1, \"time_unit\": \"ns\"},\n  \"benchmarks\": [", min_time);
+    bool first = true;
+    for(int s = 0; s < (int)sizes.size(); s++) {
+        for(int g = 0; g < (int)gem_counts.size(); g++) {
+            int n = sizes[s], gem_types = gem_counts[g];
+            GemRng rng(n * 16 + gem_types);
+            // at rest, as a player sees it
+            Board resting(n, n, gem_types);
+            if(resting.generate(rng) == 0) {
+                fprintf(stderr, "no %dx%d board with %d gem types has a legal swap in %d draws\n", n, n, gem_types,
+                        (int)Board::max_draws);
+                return 1;
+            }
+            std::vector<Move> swaps, legal;
+            for(int i = 0; i < n; i++) {
+                for(int j = 0; j < n; j++) {
+                    if(i + 1 < n) swaps.push_back(Move(i, j, i + 1, j));
+                    if(j + 1 < n) swaps.push_back(Move(i, j, i, j + 1));
+                }
+            }
+            resting.legalMoves(legal);
+            Move move = legal[rng.below(legal.size())];
+            // every cell freshly dropped in, then the same board one step further down the cascade
+            Board filled(n, n, gem_types);
+            filled.refill(rng);
+            CascadeResult ignored;
+            Board cleared = filled;
+            cleared.clearMatches(ignored);
+            Board collapsed = cleared;
+            collapsed.collapse();
+            // enough boards for whole lane groups without the batch outgrowing the caches by much
+            int boards = std::max((int)BoardBatch::lanes, std::min(1024, (1 << 18) / (n * n)));
+            
+            for(int f = 0; f < 8; f++) {
+                char name[64];
+                snprintf(name, sizeof(name), "%s/%dx%d/%d", names[f], n, n, gem_types);
+                if(!strstr(name, filter)) {
+                    continue;
+                }
+                long long iterations = 0;
+                double ns = 0;
+                GemRng op_rng(f);
+                switch(f) {
+                    case 0:
+                        ns = bench.measure(resting, [&](Board& b) {
+                            int count = 0;
+                            for(int m = 0; m < (int)swaps.size(); m++) count += b.isLegalMove(swaps[m]);
+                            return count;
+                        }, iterations);
+                        break;
+                    case 1:
+                        ns = bench.measure(filled, [&](Board& b) {
+                            CascadeResult result;
+                            return b.clearMatches(result);
+                        }, iterations);
+                        break;
+                    case 2:
+                        ns = bench.measure(cleared, [&](Board& b) {
+                            b.collapse();
+                            return b.hash();
+                        }, iterations);
+                        break;
+                    case 3:
+                        ns = bench.measure(collapsed, [&](Board& b) {
+                            b.refill(op_rng);
+                            return b.hash();
+                        }, iterations);
+                        break;
+                    case 4:
+                        ns = bench.measure(resting, [&](Board& b) {
+                            return b.quake(op_rng);
+                        }, iterations);
+                        break;
+                    case 5:
+                        ns = bench.measure(resting, [&](Board& b) {
+                            return b.play(move, op_rng).cleared;
+                        }, iterations);
+                        break;
+                    case 6: {
+                        BoardBatch batch(boards, n, n, gem_types);
+                        batch.reset(n * 16 + gem_types);
+                        std::vector<Move> moves(batch.num_of_boards);
+                        std::vector<int> gems_cleared(batch.num_of_boards);
+                        double timed = 0;
+                        while(timed < min_time) {
+                            for(int b = 0; b < batch.num_of_boards; b++) moves[b] = swaps[op_rng.below(swaps.size())];
+                            double start = wallTime();
+                            batch.step(&moves[0], &gems_cleared[0]);
+                            timed += wallTime() - start;
+                            iterations += batch.num_of_boards;
+                        }
+                        ns = timed * 1e9 / iterations;
+                        break;
+                    }
+                    case 7: {
+                        GemEnv env(boards, n, n, gem_types);
+                        std::vector<unsigned char> observations((size_t)env.num_of_envs * env.observationSize());
+                        std::vector<int> actions(env.num_of_envs);
+                        std::vector<float> rewards(env.num_of_envs);
+                        std::vector<unsigned char> dones(env.num_of_envs);
+                        env.reset(n * 16 + gem_types, &observations[0]);
+                        double timed = 0;
+                        while(timed < min_time) {
+                            for(int e = 0; e < env.num_of_envs; e++) actions[e] = op_rng.below(env.numActions());
+                            double start = wallTime();
+                            env.step(&actions[0], &rewards[0], &dones[0], &observations[0]);
+                            timed += wallTime() - start;
+                            iterations += env.num_of_envs;
+                        }
+                        ns = timed * 1e9 / iterations;
+                        break;
+                    }
+                }
+                printf("%s\n    {\"name\": \"%s\", \"routine\": \"%s\", \"cols\": %d, \"rows\": %d, \"gem_types\": %d, "
+                       "\"iterations\": %lld, \"ns_per_op\": %.2f, \"ns_per_cell\": %.4f}",
+                       first ? "" : ",", name, routines[f], n, n, gem_types, iterations, ns, ns / (n * n));
+                first = false;
+                fflush(stdout);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
 int main(int argc, char * argv[])
 {
-    srand(time(NULL));
+    // static, so they outlive main until onExit has stopped the simulation thread
+    static std::vector<unsigned char> replayed_data;
+    static RecordingView replayed;
+    
+    // headless modes never open a window, --record and --replay file --realtime play in one
+    const char* events_path = nullptr;
+    const char* headless_replay = nullptr;
+    bool alloc_check = false;
+    for(int a = 1; a < argc; a++) {
+        profiling = profiling || !strcmp(argv[a], "--profile");
+        alloc_check = alloc_check || !strcmp(argv[a], "--alloc-check");
+    }
+    for(int a = 1; a < argc; a++) {
+        if(!strcmp(argv[a], "--simulate")) {
+            return simulateMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--generate")) {
+            return generateMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--perft")) {
+            return perftMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--check")) {
+            return checkMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--bench")) {
+            return benchMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--corpus-add") || !strcmp(argv[a], "--corpus-bench")) {
+            return corpusMain(argc, argv);
+        }
+        if(!strcmp(argv[a], "--record") && a + 1 < argc) {
+            record_path = argv[++a];
+        }
+        else if(!strcmp(argv[a], "--trace") && a + 1 < argc) {
+            trace_path = argv[++a];
+        }
+        else if(!strcmp(argv[a], "--events") && a + 1 < argc) {
+            events_path = argv[++a];
+        }
+        else if(!strcmp(argv[a], "--replay") && a + 1 < argc) {
+            const char* path = argv[++a];
+            bool realtime = a + 1 < argc && !strcmp(argv[a + 1], "--realtime");
+            if(!realtime) {
+                headless_replay = path;
+                continue;
+            }
+            if(!readFile(path, replayed_data) || replayed_data.empty() ||
+               !replayed.open(&replayed_data[0], replayed_data.size())) {
+                printf("could not read recording %s\n", path);
+                return 1;
+            }
+            replay = &replayed;
+            a++;
+        }
+    }
+    if(events_path != nullptr && !event_log.open(events_path)) {
+        printf("could not write %s\n", events_path);
+        return 1;
+    }
+    if(headless_replay != nullptr) {
+        int status = replayMain(headless_replay, events_path != nullptr ? &event_log : nullptr, alloc_check);
+        event_log.close();
+        return status;
+    }
+    profiling = true;
+    if(trace_path != nullptr) {
+        // an hour at 60 frames and 120 ticks a second fits comfortably
+        trace.start(1 << 21);
+    }
 
     glutInit(&argc, argv);
 #if !defined(__APPLE__)
@@ -1434,6 +6577,8 @@ int main(int argc, char * argv[])
     printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
     
     onInitialization();
+    // GLUT may leave the main loop through exit(), make sure the simulation thread is stopped either way
+    atexit(onExit);
     
     glutDisplayFunc(onDisplay); // register event handlers
     glutKeyboardFunc(onKeyboard);
@@ -1445,7 +6590,6 @@ int main(int argc, char * argv[])
 
     
     glutMainLoop();
-    onExit();
     return 1;
 }
 